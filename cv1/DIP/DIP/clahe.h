@@ -0,0 +1,189 @@
+#pragma once
+#include "stdafx.h"
+#include "pixelkernel.h"
+#include "histogram.h"
+
+// Contrast limited adaptive histogram equalization of 8-bit gray images
+// Every tile gets its own equalization table from a clipped histogram of the window around it,
+// tables of the four nearest tiles are blended bilinearly, so there are no edges between tiles
+struct ClaheParams
+{
+	int tilesX = 8;				// Grid of tiles
+	int tilesY = 8;
+	double clipLimit = 4.0;		// Bins are clipped at clipLimit times the mean bin count, <= 0 means no clipping
+	double windowScale = 1.0;	// Histogram window around the tile relative to the tile size (>= 1, larger windows overlap)
+};
+
+// Clips histogram of area pixels and spreads clipped counts evenly over all bins, then builds the equalization table
+static void ClippedEqualizationLut(int* histogram, int area, double clipLimit, uchar* lut)
+{
+	if (clipLimit > 0)
+	{
+		int limit = std::max(1, (int)(clipLimit * area / 256));
+		int excess = 0;
+		for (int i = 0; i < 256; i++)
+		{
+			int over = histogram[i] - limit;
+			if (over > 0)
+			{
+				excess += over;
+				histogram[i] = limit;
+			}
+		}
+
+		int share = excess / 256;
+		int residual = excess - share * 256;
+		int residualStep = std::max(256 / std::max(residual, 1), 1);	// Rest goes to evenly spaced bins
+
+		for (int i = 0; i < 256; i++) { histogram[i] += share; }
+		for (int i = 0; i < 256 && residual > 0; i += residualStep, residual--) { histogram[i]++; }
+	}
+
+	float scale = area > 0 ? 255.0f / area : 0.0f;
+	int cdf = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		cdf += histogram[i];
+		lut[i] = cv::saturate_cast<uchar>(cdf * scale);
+	}
+}
+
+// Borders of count tiles over size pixels, tile t is <borders[t], borders[t + 1])
+static std::vector<int> TileBorders(int size, int count)
+{
+	std::vector<int> borders(count + 1);
+	for (int t = 0; t <= count; t++) { borders[t] = (int)((int64_t)t * size / count); }
+	return borders;
+}
+
+// For every coordinate the last tile whose center is not after it and the weight of the next tile
+// Before the first and after the last center the outermost table is used alone
+static void TileWeights(const std::vector<int>& borders, std::vector<int>& first, std::vector<float>& weight)
+{
+	int count = (int)borders.size() - 1;
+	int size = borders[count];
+	first.resize(size);
+	weight.resize(size);
+
+	int t = 0;
+	for (int x = 0; x < size; x++)
+	{
+		float position = x + 0.5f;
+		while (t < count - 1 && position >= (borders[t + 1] + borders[t + 2]) * 0.5f) t++;
+
+		float center = (borders[t] + borders[t + 1]) * 0.5f;
+		first[x] = t;
+		weight[x] = 0.0f;
+
+		if (t < count - 1 && position > center)
+		{
+			float next = (borders[t + 1] + borders[t + 2]) * 0.5f;
+			weight[x] = (position - center) / (next - center);
+		}
+	}
+}
+
+// Result is created as CV_8UC1
+// Tables are computed in parallel by rows of tiles, along a row the window histogram is updated incrementally:
+// only columns leaving and entering the window are removed and added, so the cost per pixel does not grow with the window size
+static void Clahe(const cv::Mat& src, cv::Mat& dst, const ClaheParams& params = ClaheParams())
+{
+	CV_Assert(src.type() == CV_8UC1);
+	CV_Assert(params.tilesX >= 1 && params.tilesY >= 1 && params.windowScale >= 1.0);
+
+	// Empty image has no tiles
+	if (src.empty())
+	{
+		dst.create(src.size(), CV_8UC1);
+		return;
+	}
+
+	int tilesX = std::min(params.tilesX, src.cols);
+	int tilesY = std::min(params.tilesY, src.rows);
+	std::vector<int> bordersX = TileBorders(src.cols, tilesX);
+	std::vector<int> bordersY = TileBorders(src.rows, tilesY);
+
+	std::vector<uchar> luts(tilesX * tilesY * 256);
+
+	// Window is the tile extended on both sides by the same amount for all tiles, so windows move monotonically
+	int extraX = (int)((params.windowScale - 1.0) * (src.cols / tilesX) * 0.5);
+	int extraY = (int)((params.windowScale - 1.0) * (src.rows / tilesY) * 0.5);
+
+	cv::parallel_for_(cv::Range(0, tilesY), [&](const cv::Range& range)
+	{
+		std::vector<int> banks(HistogramBanks * 256);
+		int* bank[HistogramBanks];
+		for (int b = 0; b < HistogramBanks; b++) { bank[b] = &banks[b * 256]; }
+		auto identity = [](uchar value) { return value; };
+
+		for (int ty = range.start; ty < range.end; ty++)
+		{
+			int y0 = std::max(bordersY[ty] - extraY, 0);
+			int y1 = std::min(bordersY[ty + 1] + extraY, src.rows);
+
+			int x0 = 0, x1 = 0;		// Columns currently in the histogram
+
+			for (int tx = 0; tx < tilesX; tx++)
+			{
+				int nx0 = std::max(bordersX[tx] - extraX, 0);
+				int nx1 = std::min(bordersX[tx + 1] + extraX, src.cols);
+
+				// Windows only move right, if they overlap columns on the left leave and columns on the right enter,
+				// otherwise counting the new window from zero is cheaper than removing the old one
+				int addStart = nx0;
+				int removeEnd = x0;
+				if (nx0 < x1)
+				{
+					addStart = x1;
+					removeEnd = nx0;
+				}
+				else std::fill(banks.begin(), banks.end(), 0);
+
+				for (int y = y0; y < y1; y++)
+				{
+					const uchar* row = src.ptr<uchar>(y);
+					if (removeEnd > x0) AccumulateHistogram(row + x0, removeEnd - x0, bank, identity, -1);
+					if (nx1 > addStart) AccumulateHistogram(row + addStart, nx1 - addStart, bank, identity);
+				}
+				x0 = nx0;
+				x1 = nx1;
+
+				int histogram[256];
+				for (int i = 0; i < 256; i++) { histogram[i] = bank[0][i] + bank[1][i] + bank[2][i] + bank[3][i]; }
+
+				ClippedEqualizationLut(histogram, (x1 - x0) * (y1 - y0), params.clipLimit, &luts[(ty * tilesX + tx) * 256]);
+			}
+		}
+	});
+
+	// Bilinear blending of the tables of the four nearest tiles
+	std::vector<int> firstX, firstY;
+	std::vector<float> weightX, weightY;
+	TileWeights(bordersX, firstX, weightX);
+	TileWeights(bordersY, firstY, weightY);
+
+	dst.create(src.size(), CV_8UC1);
+
+	ForEachRow<uchar>(dst, [&](int y, uchar* out, int cols)
+	{
+		const uchar* in = src.ptr<uchar>(y);
+		int ty = firstY[y];
+		int ty1 = std::min(ty + 1, tilesY - 1);
+		float wy = weightY[y];
+
+		const uchar* top = &luts[ty * tilesX * 256];
+		const uchar* bottom = &luts[ty1 * tilesX * 256];
+
+		for (int x = 0; x < cols; x++)
+		{
+			int tx = firstX[x];
+			int tx1 = std::min(tx + 1, tilesX - 1);
+			float wx = weightX[x];
+			uchar v = in[x];
+
+			float upper = top[tx * 256 + v] + (top[tx1 * 256 + v] - top[tx * 256 + v]) * wx;
+			float lower = bottom[tx * 256 + v] + (bottom[tx1 * 256 + v] - bottom[tx * 256 + v]) * wx;
+			out[x] = (uchar)(upper + (lower - upper) * wy + 0.5f);
+		}
+	}, true);
+}
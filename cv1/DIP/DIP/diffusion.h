@@ -0,0 +1,652 @@
+#pragma once
+#include "stdafx.h"
+#include "fastmath.h"
+#include <array>
+#include <functional>
+#include <mutex>
+
+// Conductance function g(d) of the gradient d between two neighbours, s = (d / sigma)^2
+enum class Conductance
+{
+	Exponential,	// exp(-s), original Perona-Malik
+	Lorentzian,		// 1 / (1 + s)
+	Tukey			// (1 - s)^2 for s < 1, zero otherwise
+};
+
+// How the exponential conductance is evaluated, rational functions are always exact (they are already cheap)
+//   Exact       - std::exp
+//   Approximate - exp2 split into exponent bits and 5th degree polynomial, relative error < 1e-7 (+ float rounding)
+//   Table       - 4096 entries over s in <0, 16> with linear interpolation, absolute error < 2e-6 (s > 16 is clamped to exp(-16) ~ 1e-7)
+enum class ConductanceEvaluation
+{
+	Exact,
+	Approximate,
+	Table
+};
+
+// Time stepping of the diffusion equation
+//   Explicit - forward Euler, stable only for delta <= 0.25, border pixels stay fixed
+//   Aos      - semi-implicit additive operator splitting, stable for any delta, reflecting border
+enum class DiffusionScheme
+{
+	Explicit,
+	Aos
+};
+
+// Change of the image in one iteration
+struct DiffusionResidual
+{
+	int iteration = 0;
+	double maxUpdate = 0.0;		// Largest absolute change of a pixel
+	double meanUpdate = 0.0;	// Mean absolute change over updated pixels
+	int64 updatedPixels = 0;	// Pixels computed in this iteration
+	int level = 0;				// Pyramid level, 0 is full resolution
+};
+
+struct DiffusionParams
+{
+	int iterations = 100;								// Number of explicit steps
+	double sigma = 0.015;								// Gradient that is still considered as an edge
+	double delta = 0.1;									// Time step, explicit scheme is stable for delta <= 0.25
+	DiffusionScheme scheme = DiffusionScheme::Explicit;
+	Conductance conductance = Conductance::Exponential;
+	ConductanceEvaluation evaluation = ConductanceEvaluation::Exact;
+	int blocking = 1;									// Iterations done on one tile at a time, 1 means whole image sweeps (explicit only)
+	int tileSize = 128;									// Tile size for blocking, tile with its halo should fit into L2 cache
+
+	// Active set, tiles whose pixels moved less than activeEpsilon are skipped together with their neighbours (explicit only, no blocking)
+	double activeEpsilon = 0.0;							// 0 disables the active set
+	int activeTileSize = 32;
+
+	// Coarse to fine, iterations are done on the coarsest level, every finer level gets fineIterations
+	int pyramidLevels = 1;								// 1 means no pyramid
+	int fineIterations = 10;
+
+	// Early stopping, 0 disables the criterion, with blocking the criteria are checked after every block
+	double maxTolerance = 0.0;							// Stop when the largest pixel update is below this
+	double meanTolerance = 0.0;							// Stop when the mean pixel update is below this
+	std::function<bool(const DiffusionResidual&)> callback;	// Called after every iteration, returning false stops
+};
+
+// How much work the diffusion needed
+struct DiffusionReport
+{
+	int iterations = 0;							// Iterations actually done, on all pyramid levels
+	bool converged = false;						// Stopped by tolerance (on the finest level)
+	bool settled = false;						// Stopped because no tile of the active set moved anymore (on the finest level)
+	std::vector<DiffusionResidual> residuals;	// One entry per iteration
+};
+
+// Images reused between calls, so repeated diffusion of same sized images does not allocate
+struct DiffusionWorkspace
+{
+	std::vector<std::array<cv::Mat, 2>> buffers;	// Ping-pong pair of every pyramid level
+	std::vector<cv::Mat> pyramid;	// Downsampled input, level 0 is not stored
+	std::vector<cv::Mat> diffused;	// Diffused levels
+	cv::Mat correction;				// Change of coarser level upsampled to current level
+};
+
+// Residual accumulated over part of the image
+struct ResidualSum
+{
+	double max = 0.0;
+	double sum = 0.0;
+	int64 count = 0;
+
+	void Add(const ResidualSum& other)
+	{
+		max = std::max(max, other.max);
+		sum += other.sum;
+		count += other.count;
+	}
+};
+
+// exp(-s) for s >= 0, without branches so loops over it can be vectorized
+template <typename T> static inline T FastExpNegative(T s)
+{
+	return FastExp2(-s * (T)M_LOG2E);		// exp(-s) = 2^y, tiny results are flushed to ~2^-125
+}
+
+// Evaluates conductance g(d) or flux g(d) * d for whole rows of differences
+template <typename T> class ConductanceEvaluator
+{
+public:
+	ConductanceEvaluator(const DiffusionParams& params)
+		: function(params.conductance), evaluation(params.evaluation), k((T)(1.0 / (params.sigma * params.sigma)))
+	{
+		if (function == Conductance::Exponential && evaluation == ConductanceEvaluation::Table)
+		{
+			table.resize(TableSize + 2);
+			for (int i = 0; i <= TableSize; i++)
+			{
+				table[i] = (T)std::exp(-(double)i * TableRange / TableSize);
+			}
+			table[TableSize + 1] = table[TableSize];	// Interpolation at the very end reads one entry further
+		}
+	}
+
+	// flux[i] = g(d[i]) * d[i], flux may be the same array as d
+	void Flux(const T* d, T* flux, int n) const { Apply<true>(d, flux, n); }
+
+	// g[i] = g(d[i]), g may be the same array as d
+	void Evaluate(const T* d, T* g, int n) const { Apply<false>(d, g, n); }
+
+private:
+	template <bool IsFlux> static T Output(T g, T d) { return IsFlux ? g * d : g; }
+
+	template <bool IsFlux> void Apply(const T* d, T* out, int n) const
+	{
+		switch (function)
+		{
+		case Conductance::Exponential:
+			if (evaluation == ConductanceEvaluation::Exact)
+			{
+				for (int i = 0; i < n; i++) { T v = d[i]; out[i] = Output<IsFlux>(std::exp(-v * v * k), v); }
+			}
+			else if (evaluation == ConductanceEvaluation::Approximate)
+			{
+				for (int i = 0; i < n; i++) { T v = d[i]; out[i] = Output<IsFlux>(FastExpNegative(v * v * k), v); }
+			}
+			else
+			{
+				const T* t = table.data();
+				T scale = (T)(TableSize / TableRange);
+				for (int i = 0; i < n; i++)
+				{
+					T v = d[i];
+					T x = std::min(v * v * k * scale, (T)TableSize);
+					int j = (int)x;
+					out[i] = Output<IsFlux>(t[j] + (x - j) * (t[j + 1] - t[j]), v);
+				}
+			}
+			break;
+		case Conductance::Lorentzian:
+			for (int i = 0; i < n; i++) { T v = d[i]; out[i] = Output<IsFlux>(1 / (1 + v * v * k), v); }
+			break;
+		case Conductance::Tukey:
+			for (int i = 0; i < n; i++)
+			{
+				T v = d[i];
+				T w = std::max(1 - v * v * k, (T)0);
+				out[i] = Output<IsFlux>(w * w, v);
+			}
+			break;
+		}
+	}
+
+	static const int TableSize = 4096;
+	static constexpr double TableRange = 16.0;
+
+	Conductance function;
+	ConductanceEvaluation evaluation;
+	T k;				// 1 / sigma^2
+	std::vector<T> table;
+};
+
+// One explicit step from src to dst for pixels inside region, region has to keep one pixel distance from image border
+// Every edge flux is computed once and used by both pixels it connects
+// If residual is given, absolute updates of pixels inside region & measure are accumulated into it
+template <typename T> static void DiffusionStep(const cv::Mat& src, cv::Mat& dst, const cv::Rect& region, T delta, const ConductanceEvaluator<T>& conductance,
+	std::vector<T>& buffer, ResidualSum* residual = nullptr, const cv::Rect& measure = cv::Rect())
+{
+	if (region.width <= 0 || region.height <= 0) return;
+
+	int x0 = region.x;
+	int width = region.width;
+	buffer.resize(3 * width + 1);
+
+	T* fluxX = buffer.data();				// fluxX[i] is flux between x0 + i - 1 and x0 + i in current row
+	T* fluxUp = fluxX + width + 1;			// fluxUp[i] is flux between row r - 1 and r in column x0 + i
+	T* fluxDown = fluxUp + width;			// fluxDown[i] is flux between row r and r + 1 in column x0 + i
+
+	const T* first = src.ptr<T>(region.y - 1) + x0;
+	const T* second = src.ptr<T>(region.y) + x0;
+	for (int i = 0; i < width; i++) { fluxUp[i] = second[i] - first[i]; }
+	conductance.Flux(fluxUp, fluxUp, width);
+
+	for (int r = region.y; r < region.y + region.height; r++)
+	{
+		const T* row = src.ptr<T>(r) + x0;
+		const T* down = src.ptr<T>(r + 1) + x0;
+		T* out = dst.ptr<T>(r) + x0;
+
+		for (int i = 0; i <= width; i++) { fluxX[i] = row[i] - row[i - 1]; }
+		conductance.Flux(fluxX, fluxX, width + 1);
+
+		for (int i = 0; i < width; i++) { fluxDown[i] = down[i] - row[i]; }
+		conductance.Flux(fluxDown, fluxDown, width);
+
+		for (int i = 0; i < width; i++)
+		{
+			out[i] = row[i] + delta * ((fluxX[i + 1] - fluxX[i]) + (fluxDown[i] - fluxUp[i]));
+		}
+
+		// Residual is taken from the row that is still in cache
+		if (residual && r >= measure.y && r < measure.y + measure.height)
+		{
+			int from = std::max(measure.x, x0) - x0;
+			int to = std::min(measure.x + measure.width, x0 + width) - x0;
+			T maxUpdate = 0, sumUpdate = 0;
+
+			for (int i = from; i < to; i++)
+			{
+				T update = std::abs(out[i] - row[i]);
+				maxUpdate = std::max(maxUpdate, update);
+				sumUpdate += update;
+			}
+
+			residual->max = std::max(residual->max, (double)maxUpdate);
+			residual->sum += sumUpdate;
+			residual->count += std::max(to - from, 0);
+		}
+
+		std::swap(fluxUp, fluxDown);	// Lower edge of this row is upper edge of the next one
+	}
+}
+
+// Advances steps iterations from src to dst tile by tile (temporal blocking)
+// Every tile is loaded with a halo of steps pixels and iterated in a small local buffer that stays in cache,
+// the valid area shrinks by one pixel each step, so after the last step the tile itself is exact
+// Pixels are computed by the same operations in the same order as in plain sweeps, so the result is identical
+// If residuals are given (one per step), updates of every pixel are counted once, by the tile that owns it
+template <typename T> static void DiffusionBlock(const cv::Mat& src, cv::Mat& dst, int steps, int tileSize, T delta, const ConductanceEvaluator<T>& conductance,
+	ResidualSum* residuals = nullptr)
+{
+	cv::Rect image(0, 0, src.cols, src.rows);
+	cv::Rect interior(1, 1, src.cols - 2, src.rows - 2);
+
+	int tilesX = (src.cols + tileSize - 1) / tileSize;
+	int tilesY = (src.rows + tileSize - 1) / tileSize;
+
+	std::mutex residualLock;
+
+	cv::parallel_for_(cv::Range(0, tilesX * tilesY), [&](const cv::Range& range)
+	{
+		// Ping-pong buffers of this worker, allocated once per chunk and reused by all its tiles
+		// They are not kept in the workspace: a tile is at most (tileSize + 2 steps)^2 pixels and stays in cache
+		cv::Mat local[2];
+		std::vector<T> buffer;
+		std::vector<ResidualSum> localResiduals(residuals ? steps : 0);
+
+		for (int t = range.start; t < range.end; t++)
+		{
+			cv::Rect core = cv::Rect((t % tilesX) * tileSize, (t / tilesX) * tileSize, tileSize, tileSize) & image;
+			cv::Rect area = cv::Rect(core.x - steps, core.y - steps, core.width + 2 * steps, core.height + 2 * steps) & image;
+
+			src(area).copyTo(local[0]);
+			src(area).copyTo(local[1]);
+
+			for (int k = 0; k < steps; k++)
+			{
+				int grow = steps - 1 - k;	// Area that is still valid after remaining steps
+				cv::Rect region = cv::Rect(core.x - grow, core.y - grow, core.width + 2 * grow, core.height + 2 * grow) & interior;
+				DiffusionStep<T>(local[k % 2], local[(k + 1) % 2], region - area.tl(), delta, conductance, buffer,
+					residuals ? &localResiduals[k] : nullptr, core - area.tl());
+			}
+
+			local[steps % 2](core - area.tl()).copyTo(dst(core));
+		}
+
+		if (residuals)
+		{
+			std::lock_guard<std::mutex> guard(residualLock);
+			for (int k = 0; k < steps; k++) { residuals[k].Add(localResiduals[k]); }
+		}
+	});
+}
+
+// One AOS step, dst = ((I - 2 delta Ax)^-1 + (I - 2 delta Ay)^-1) src / 2
+// Ax and Ay use the same edge conductances as the explicit scheme, every tridiagonal system is solved by Thomas algorithm
+// Rows are solved in parallel, columns are solved in parallel bands, all columns of a band move down together
+template <typename T> static void AosStep(const cv::Mat& src, cv::Mat& dst, T delta, const ConductanceEvaluator<T>& conductance, ResidualSum* residual = nullptr)
+{
+	int rows = src.rows;
+	int cols = src.cols;
+	T tau = 2 * delta;
+
+	// Rows, result of the x direction is stored in dst
+	cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range& range)
+	{
+		std::vector<T> buffer(3 * cols);
+		T* g = buffer.data();			// g[i] is conductance between i and i + 1
+		T* cp = g + cols;				// Modified upper diagonal
+		T* dp = cp + cols;				// Modified right side
+
+		for (int r = range.start; r < range.end; r++)
+		{
+			const T* u = src.ptr<T>(r);
+			T* out = dst.ptr<T>(r);
+
+			for (int i = 0; i < cols - 1; i++) { g[i] = u[i + 1] - u[i]; }
+			g[cols - 1] = 0;
+			conductance.Evaluate(g, g, cols - 1);
+
+			T left = 0, cPrev = 0, dPrev = 0;
+			for (int i = 0; i < cols; i++)
+			{
+				T a = -tau * left;
+				T c = -tau * g[i];
+				T m = 1 - a - c - a * cPrev;
+				cp[i] = cPrev = c / m;
+				dp[i] = dPrev = (u[i] - a * dPrev) / m;
+				left = g[i];
+			}
+
+			out[cols - 1] = dp[cols - 1];
+			for (int i = cols - 2; i >= 0; i--) { out[i] = dp[i] - cp[i] * out[i + 1]; }
+		}
+	});
+
+	// Columns, result is averaged with the rows
+	const int bandWidth = 64;
+	int bands = (cols + bandWidth - 1) / bandWidth;
+	std::mutex residualLock;
+
+	cv::parallel_for_(cv::Range(0, bands), [&](const cv::Range& range)
+	{
+		std::vector<T> buffer((2 * rows + 4) * bandWidth);
+		T* gUp = buffer.data();			// Conductance between row r - 1 and r
+		T* gDown = gUp + bandWidth;		// Conductance between row r and r + 1
+		T* v = gDown + bandWidth;		// Solution of the row below
+		T* zero = v + bandWidth;
+		T* cp = zero + bandWidth;		// Modified upper diagonal of all rows
+		T* dp = cp + rows * bandWidth;	// Modified right side of all rows
+		ResidualSum localResidual;
+
+		for (int band = range.start; band < range.end; band++)
+		{
+			int c0 = band * bandWidth;
+			int width = std::min(bandWidth, cols - c0);
+
+			std::fill(zero, zero + width, (T)0);
+			std::fill(gUp, gUp + width, (T)0);
+
+			for (int r = 0; r < rows; r++)
+			{
+				const T* u = src.ptr<T>(r) + c0;
+				const T* cPrev = r > 0 ? cp + (r - 1) * bandWidth : zero;
+				const T* dPrev = r > 0 ? dp + (r - 1) * bandWidth : zero;
+				T* cRow = cp + r * bandWidth;
+				T* dRow = dp + r * bandWidth;
+
+				if (r < rows - 1)
+				{
+					const T* down = src.ptr<T>(r + 1) + c0;
+					for (int j = 0; j < width; j++) { gDown[j] = down[j] - u[j]; }
+					conductance.Evaluate(gDown, gDown, width);
+				}
+				else std::fill(gDown, gDown + width, (T)0);
+
+				for (int j = 0; j < width; j++)
+				{
+					T a = -tau * gUp[j];
+					T c = -tau * gDown[j];
+					T m = 1 - a - c - a * cPrev[j];
+					cRow[j] = c / m;
+					dRow[j] = (u[j] - a * dPrev[j]) / m;
+				}
+
+				std::swap(gUp, gDown);
+			}
+
+			std::fill(v, v + width, (T)0);
+			for (int r = rows - 1; r >= 0; r--)
+			{
+				const T* cRow = cp + r * bandWidth;
+				const T* dRow = dp + r * bandWidth;
+				const T* u = src.ptr<T>(r) + c0;
+				T* out = dst.ptr<T>(r) + c0;
+
+				for (int j = 0; j < width; j++)
+				{
+					v[j] = dRow[j] - cRow[j] * v[j];
+					out[j] = (out[j] + v[j]) / 2;
+				}
+
+				if (residual)
+				{
+					for (int j = 0; j < width; j++)
+					{
+						T update = std::abs(out[j] - u[j]);
+						localResidual.max = std::max(localResidual.max, (double)update);
+						localResidual.sum += update;
+					}
+					localResidual.count += width;
+				}
+			}
+		}
+
+		if (residual)
+		{
+			std::lock_guard<std::mutex> guard(residualLock);
+			residual->Add(localResidual);
+		}
+	});
+}
+
+// Tiles that are still moving, for the active set mode
+struct ActiveTiles
+{
+	int tilesX = 0;
+	int tilesY = 0;
+	int tileSize = 0;
+	std::vector<uchar> active;		// Tile moved by more than epsilon in the last sweep
+	std::vector<uchar> visited;		// Tile was computed in the last sweep
+
+	ActiveTiles(const cv::Size& size, int tileSize)
+		: tilesX((size.width + tileSize - 1) / tileSize), tilesY((size.height + tileSize - 1) / tileSize), tileSize(tileSize),
+		active(tilesX * tilesY, 1), visited(tilesX * tilesY, 1)
+	{
+	}
+
+	cv::Rect Tile(int t) const { return cv::Rect((t % tilesX) * tileSize, (t / tilesX) * tileSize, tileSize, tileSize); }
+};
+
+// One explicit step over active tiles and their neighbours, other pixels keep their values
+// Returns false if no tile is active anymore
+template <typename T> static bool ActiveDiffusionStep(const cv::Mat& src, cv::Mat& dst, ActiveTiles& tiles, T delta, const ConductanceEvaluator<T>& conductance,
+	double epsilon, ResidualSum* residual = nullptr)
+{
+	cv::Rect interior(1, 1, src.cols - 2, src.rows - 2);
+	int count = tiles.tilesX * tiles.tilesY;
+
+	// Active tiles can push changes to their neighbours, so neighbours are computed too
+	std::vector<int> visit;
+	std::vector<uchar> visited(count, 0);
+	for (int t = 0; t < count; t++)
+	{
+		int tx = t % tiles.tilesX;
+		int ty = t / tiles.tilesX;
+
+		for (int y = std::max(ty - 1, 0); y <= std::min(ty + 1, tiles.tilesY - 1) && !visited[t]; y++)
+		{
+			for (int x = std::max(tx - 1, 0); x <= std::min(tx + 1, tiles.tilesX - 1); x++)
+			{
+				if (tiles.active[y * tiles.tilesX + x]) { visited[t] = 1; break; }
+			}
+		}
+
+		if (visited[t]) visit.push_back(t);
+		else if (tiles.visited[t]) src(tiles.Tile(t) & interior).copyTo(dst(tiles.Tile(t) & interior));	// Second buffer still holds older values
+	}
+
+	std::vector<uchar> active(count, 0);
+	std::mutex residualLock;
+
+	cv::parallel_for_(cv::Range(0, (int)visit.size()), [&](const cv::Range& range)
+	{
+		std::vector<T> buffer;
+		ResidualSum localResidual;
+
+		for (int i = range.start; i < range.end; i++)
+		{
+			cv::Rect region = tiles.Tile(visit[i]) & interior;
+			ResidualSum tileResidual;
+			DiffusionStep<T>(src, dst, region, delta, conductance, buffer, &tileResidual, region);
+
+			active[visit[i]] = tileResidual.max > epsilon;
+			localResidual.Add(tileResidual);
+		}
+
+		if (residual)
+		{
+			std::lock_guard<std::mutex> guard(residualLock);
+			residual->Add(localResidual);
+		}
+	});
+
+	tiles.active.swap(active);
+	tiles.visited.swap(visited);
+
+	return !visit.empty();
+}
+
+template <typename T> static void DiffusionIterations(cv::Mat& current, cv::Mat& next, const DiffusionParams& params, DiffusionReport* report)
+{
+	ConductanceEvaluator<T> conductance(params);
+	std::vector<T> buffer;
+	cv::Rect interior(1, 1, current.cols - 2, current.rows - 2);
+	T delta = (T)params.delta;
+
+	// Residuals are computed only when somebody needs them
+	bool monitor = report || params.callback || params.maxTolerance > 0.0 || params.meanTolerance > 0.0;
+	std::vector<ResidualSum> residuals;
+
+	bool activeSet = params.scheme == DiffusionScheme::Explicit && params.activeEpsilon > 0.0;
+	ActiveTiles tiles(current.size(), params.activeTileSize);
+
+	int k = 0;
+	bool stop = false;
+
+	while (k < params.iterations && !stop)
+	{
+		int steps = params.scheme == DiffusionScheme::Explicit && !activeSet ? std::min(params.blocking, params.iterations - k) : 1;
+		residuals.assign(monitor ? steps : 0, ResidualSum());
+
+		if (params.scheme == DiffusionScheme::Aos) AosStep<T>(current, next, delta, conductance, monitor ? residuals.data() : nullptr);
+		else if (activeSet)
+		{
+			if (!ActiveDiffusionStep<T>(current, next, tiles, delta, conductance, params.activeEpsilon, monitor ? residuals.data() : nullptr))
+			{
+				// Nothing moves anymore, further iterations would not change anything
+				if (report) report->settled = true;
+				break;
+			}
+		}
+		else if (steps > 1) DiffusionBlock<T>(current, next, steps, params.tileSize, delta, conductance, monitor ? residuals.data() : nullptr);
+		else DiffusionStep<T>(current, next, interior, delta, conductance, buffer, monitor ? residuals.data() : nullptr, interior);
+
+		std::swap(current, next);	// Buffers are swapped instead of copied
+
+		for (int i = 0; i < (int)residuals.size(); i++)
+		{
+			DiffusionResidual residual;
+			residual.iteration = k + i;
+			residual.maxUpdate = residuals[i].max;
+			residual.meanUpdate = residuals[i].count > 0 ? residuals[i].sum / residuals[i].count : 0.0;
+			residual.updatedPixels = residuals[i].count;
+
+			if (report) report->residuals.push_back(residual);
+			if (stop) continue;		// Rest of the block is only reported
+
+			if ((params.maxTolerance > 0.0 && residual.maxUpdate < params.maxTolerance) ||
+				(params.meanTolerance > 0.0 && residual.meanUpdate < params.meanTolerance))
+			{
+				stop = true;
+				if (report) report->converged = true;
+			}
+
+			if (params.callback && !params.callback(residual)) stop = true;
+		}
+
+		k += steps;
+	}
+
+	if (report) report->iterations += k;
+}
+
+// Diffusion of one image, result is left in buffers[0]
+static void DiffuseLevel(const cv::Mat& src, const DiffusionParams& params, DiffusionReport* report, std::array<cv::Mat, 2>& buffers, int level)
+{
+	// Both buffers start as a copy, so both carry the fixed border
+	src.copyTo(buffers[0]);
+	src.copyTo(buffers[1]);
+
+	size_t first = report ? report->residuals.size() : 0;
+	if (report)
+	{
+		report->converged = false;
+		report->settled = false;
+	}
+
+	if (src.depth() == CV_32F) DiffusionIterations<float>(buffers[0], buffers[1], params, report);
+	else DiffusionIterations<double>(buffers[0], buffers[1], params, report);
+
+	if (report)
+	{
+		for (size_t i = first; i < report->residuals.size(); i++) { report->residuals[i].level = level; }
+	}
+}
+
+// Result shares memory with the buffer unless the buffer belongs to a workspace
+static void TakeResult(cv::Mat& buffer, cv::Mat& result, bool pooled)
+{
+	if (pooled) buffer.copyTo(result);
+	else result = buffer;
+}
+
+// Perona-Malik anisotropic diffusion of CV_32FC1 or CV_64FC1 image, result has the same type
+// Report (optional) receives number of iterations done and residual of every iteration
+// Workspace (optional) keeps all buffers and pyramid levels for the next call
+static void AnisotropicDiffusion(const cv::Mat& original, cv::Mat& result, const DiffusionParams& params, DiffusionReport* report = nullptr,
+	DiffusionWorkspace* workspace = nullptr)
+{
+	CV_Assert(original.type() == CV_32FC1 || original.type() == CV_64FC1);
+	CV_Assert(params.blocking >= 1 && params.tileSize >= 1 && params.activeTileSize >= 1 && params.pyramidLevels >= 1);
+
+	DiffusionWorkspace localWorkspace;
+	DiffusionWorkspace& ws = workspace ? *workspace : localWorkspace;
+
+	if (report) *report = DiffusionReport();
+
+	int levels = params.pyramidLevels;
+	ws.buffers.resize(levels);
+
+	if (levels == 1)
+	{
+		DiffuseLevel(original, params, report, ws.buffers[0], 0);
+		TakeResult(ws.buffers[0][0], result, workspace != nullptr);
+		return;
+	}
+
+	ws.pyramid.resize(levels);
+	ws.diffused.resize(levels);
+
+	// Level 0 is the original itself
+	for (int l = 1; l < levels; l++)
+	{
+		cv::pyrDown(l == 1 ? original : ws.pyramid[l - 1], ws.pyramid[l]);
+	}
+
+	// Long distance diffusion is cheap on the coarsest level
+	DiffuseLevel(ws.pyramid[levels - 1], params, report, ws.buffers[levels - 1], levels - 1);
+	ws.buffers[levels - 1][0].copyTo(ws.diffused[levels - 1]);
+
+	DiffusionParams fineParams = params;
+	fineParams.iterations = params.fineIterations;
+
+	for (int l = levels - 2; l >= 0; l--)
+	{
+		const cv::Mat& level = l == 0 ? original : ws.pyramid[l];
+
+		// Only the change made by the coarser level is upsampled, details of this level are kept
+		cv::subtract(ws.diffused[l + 1], ws.pyramid[l + 1], ws.diffused[l + 1]);
+		cv::pyrUp(ws.diffused[l + 1], ws.correction, level.size());
+		cv::add(level, ws.correction, ws.diffused[l]);
+
+		DiffuseLevel(ws.diffused[l], fineParams, report, ws.buffers[l], l);
+
+		if (l > 0) ws.buffers[l][0].copyTo(ws.diffused[l]);
+		else TakeResult(ws.buffers[l][0], result, workspace != nullptr);
+	}
+}
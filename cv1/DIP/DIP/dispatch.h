@@ -0,0 +1,25 @@
+#pragma once
+#include "stdafx.h"
+
+// Compile-time dispatch on Mat::depth(), an operation is written once as a template over the channel type
+// and a specialized kernel is instantiated for every supported type, images are processed at their own depth
+// Usage: DispatchDepth(image.depth(), [&](auto value) { Kernel<decltype(value)>(image); });
+
+// Full scale of one channel, floating point images are expected in <0, 1>
+template <typename T> struct PixelRange { static double Max() { return 1.0; } };
+template <> struct PixelRange<uchar> { static double Max() { return 255.0; } };
+template <> struct PixelRange<ushort> { static double Max() { return 65535.0; } };
+
+// f(T()) where T is the type of one channel: uchar, ushort, float or double
+template <typename Functor>
+static void DispatchDepth(int depth, Functor f)
+{
+	switch (depth)
+	{
+	case CV_8U: f(uchar()); break;
+	case CV_16U: f(ushort()); break;
+	case CV_32F: f(float()); break;
+	case CV_64F: f(double()); break;
+	default: CV_Error(cv::Error::StsUnsupportedFormat, "Only 8U, 16U, 32F and 64F images are supported");
+	}
+}
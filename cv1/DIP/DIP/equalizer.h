@@ -0,0 +1,159 @@
+#pragma once
+#include "stdafx.h"
+#include "histogram.h"
+#include "pointops.h"
+
+// Histogram equalization of a video stream (8-bit gray or luma of BGR frames)
+// The histogram is smoothed over frames, so the mapping does not flicker with noise,
+// and the table is rebuilt only when the smoothed distribution has moved far enough from the one it was built for
+struct TemporalEqualizerParams
+{
+	double smoothing = 0.1;		// Weight of the new frame in the smoothed histogram, 1 means no smoothing
+	double threshold = 0.01;	// Table is rebuilt when the largest difference of cumulative distributions exceeds this, 0 rebuilds every frame
+	int subsample = 1;			// Histogram is counted on every subsample-th pixel of every subsample-th row (2 means 4x fewer pixels)
+};
+
+class TemporalEqualizer
+{
+public:
+	TemporalEqualizer(const TemporalEqualizerParams& params = TemporalEqualizerParams()) : params(params)
+	{
+		CV_Assert(params.smoothing > 0 && params.smoothing <= 1 && params.subsample >= 1);
+		Reset();
+	}
+
+	// Starts again from the next frame
+	void Reset()
+	{
+		frames = 0;
+		rebuilt = false;
+	}
+
+	// Equalizes frame into result, result may be the frame itself
+	void Apply(const cv::Mat& frame, cv::Mat& result)
+	{
+		CV_Assert(frame.type() == CV_8UC1 || frame.type() == CV_8UC3);
+
+		int histogram[256];
+		Statistics(frame, histogram);
+
+		int counted = 0;
+		for (int i = 0; i < 256; i++) { counted += histogram[i]; }
+
+		// Exponential smoothing of probabilities, so frame size and subsampling do not matter
+		for (int i = 0; i < 256; i++)
+		{
+			double probability = counted > 0 ? (double)histogram[i] / counted : 0.0;
+			smoothed[i] = frames == 0 ? probability : smoothed[i] + (probability - smoothed[i]) * params.smoothing;
+		}
+		frames++;
+
+		rebuilt = frames == 1 || Shift() > params.threshold;
+		if (rebuilt) Rebuild();
+
+		if (frame.channels() == 1) ApplyLut(frame, result, lut);
+		else ApplyLumaLut(frame, result, lut);
+	}
+
+	// True if the last frame caused the table to be rebuilt
+	bool Rebuilt() const { return rebuilt; }
+
+	const uchar* Lut() const { return lut; }
+
+private:
+	void Statistics(const cv::Mat& frame, int* histogram) const
+	{
+		if (params.subsample == 1)
+		{
+			if (frame.channels() == 1) ComputeHistogram(frame, histogram);
+			else ComputeLumaHistogram(frame, histogram);
+		}
+		else if (frame.channels() == 1)
+		{
+			SubsampledHistogram<uchar>(frame, histogram, 256, params.subsample, [](uchar value) { return value; });
+		}
+		else SubsampledHistogram<cv::Vec3b>(frame, histogram, 256, params.subsample, [](const cv::Vec3b& pixel) { return Luma(pixel); });
+	}
+
+	// Largest difference between cumulative distribution now and when the table was built
+	double Shift() const
+	{
+		double now = 0.0, then = 0.0, shift = 0.0;
+		for (int i = 0; i < 256; i++)
+		{
+			now += smoothed[i];
+			then += built[i];
+			shift = std::max(shift, std::abs(now - then));
+		}
+		return shift;
+	}
+
+	void Rebuild()
+	{
+		// Probabilities as fixed point counts for the common equalization table
+		const double scale = 1 << 20;
+		int counts[256];
+		int total = 0;
+		for (int i = 0; i < 256; i++)
+		{
+			counts[i] = (int)(smoothed[i] * scale + 0.5);
+			total += counts[i];
+		}
+
+		EqualizationLut(counts, total, lut);
+		std::copy(smoothed, smoothed + 256, built);
+	}
+
+	TemporalEqualizerParams params;
+	double smoothed[256];	// Smoothed probabilities of gray levels
+	double built[256];		// Probabilities the table was built from
+	uchar lut[256];
+	int frames;
+	bool rebuilt;
+};
+
+// Histogram specification of images to the look of one reference image (8-bit gray or BGR, channels are matched separately)
+// Reference cdfs are computed once, every image then costs one histogram and one table pass
+class HistogramMatcher
+{
+public:
+	HistogramMatcher(const cv::Mat& reference)
+	{
+		CV_Assert(reference.type() == CV_8UC1 || reference.type() == CV_8UC3);
+
+		int histograms[3][256];
+		int* channels[3] = { histograms[0], histograms[1], histograms[2] };
+
+		if (reference.channels() == 1) ComputeHistogram(reference, histograms[0]);
+		else ComputeChannelHistograms(reference, channels);
+
+		references.resize(reference.channels());
+		for (int c = 0; c < reference.channels(); c++) { BuildReferenceCdf(histograms[c], references[c]); }
+	}
+
+	// image must have the same number of channels as the reference, result may be the image itself
+	void Apply(const cv::Mat& image, cv::Mat& result) const
+	{
+		CV_Assert(image.depth() == CV_8U && image.channels() == (int)references.size());
+
+		int histograms[3][256];
+		int* channels[3] = { histograms[0], histograms[1], histograms[2] };
+		uchar luts[3 * 256];
+
+		if (image.channels() == 1)
+		{
+			ComputeHistogram(image, histograms[0]);
+			SpecificationLut(histograms[0], references[0], luts);
+			ApplyLut(image, result, luts);
+			return;
+		}
+
+		ComputeChannelHistograms(image, channels);
+
+		for (int c = 0; c < 3; c++) { SpecificationLut(histograms[c], references[c], luts + c * 256); }
+		ApplyChannelLuts(image, result, luts);
+	}
+
+private:
+	std::vector<ReferenceCdf> references;
+};
@@ -0,0 +1,75 @@
+#pragma once
+#include "stdafx.h"
+
+// Branch free approximations of exp2, log2 and pow, loops over them can be vectorized
+
+// 2^n for integer n, built directly from exponent bits
+static inline float Pow2Int(int n, float)
+{
+	int32_t bits = (int32_t)(n + 127) << 23;
+	float result;
+	memcpy(&result, &bits, sizeof(result));
+	return result;
+}
+
+static inline double Pow2Int(int n, double)
+{
+	int64_t bits = (int64_t)(n + 1023) << 52;
+	double result;
+	memcpy(&result, &bits, sizeof(result));
+	return result;
+}
+
+// 2^y, relative error 7.5e-8 for y in <-125, max>, max is 127 for float and 1023 for double
+// Results outside are clamped to 2^-125 and 2^max, so the exponent bits never overflow into the sign
+template <typename T> static inline T FastExp2(T y)
+{
+	y = std::min(std::max(y, (T)-125), (T)(std::numeric_limits<T>::max_exponent - 1));
+	T n = std::floor(y);
+	T f = y - n;								// 2^y = 2^n * 2^f, f in <0, 1)
+
+	// Polynomial fit of 2^f on <0, 1>, relative error 7.5e-8
+	T p = (T)0.0018775763202374823;
+	p = p * f + (T)0.008989340966614343;
+	p = p * f + (T)0.055826317299889905;
+	p = p * f + (T)0.24015361730675505;
+	p = p * f + (T)0.6931530731686747;
+	p = p * f + (T)0.9999999250641087;
+
+	return p * Pow2Int((int)n, T());
+}
+
+// log2(x) for normal x > 0, absolute error 1.2e-7 for x near 1, elsewhere limited by float rounding of the result
+static inline float FastLog2(float x)
+{
+	int32_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	float exponent = (float)(((bits >> 23) & 255) - 127);
+
+	bits = (bits & 0x007fffff) | 0x3f800000;	// Mantissa m in <1, 2)
+	float m;
+	memcpy(&m, &bits, sizeof(m));
+
+	// Mantissa is moved to <sqrt(1/2), sqrt(2)), where the series below converges fast
+	float upper = m > 1.41421356f ? 1.0f : 0.0f;
+	m *= 1.0f - 0.5f * upper;
+	exponent += upper;
+
+	// log2(m) = 2 / ln(2) * atanh(t), |t| < 0.172
+	float t = (m - 1.0f) / (m + 1.0f);
+	float t2 = t * t;
+	float p = t2 * (1.0f / 9.0f) + (1.0f / 7.0f);
+	p = p * t2 + (1.0f / 5.0f);
+	p = p * t2 + (1.0f / 3.0f);
+	p = p * t2 + 1.0f;
+
+	return exponent + p * t * 2.8853900817779268f;
+}
+
+// x^e for x > 0 as 2^(e * log2(x)), zero for x <= 0, results above 2^127 are clamped to 2^127
+// Relative error grows with |e * log2(x)| because of float rounding, it is below 7e-6 for x in <2^-16, 1> and |e| <= 10
+static inline float FastPow(float x, float e)
+{
+	float y = FastExp2(e * FastLog2(std::max(x, FLT_MIN)));
+	return x > 0.0f ? y : 0.0f;
+}
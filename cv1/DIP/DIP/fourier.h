@@ -0,0 +1,103 @@
+#pragma once
+#include "stdafx.h"
+
+// Spatial kernel of size (2 * halo + 1) for a centered frequency mask (same meaning as in ApplyMask)
+static cv::Mat SpectralKernel(const cv::Mat& mask, int halo)
+{
+	int size = 2 * halo + 1;
+	cv::Mat kernel(size, size, CV_64FC1, cv::Scalar(0.0));
+
+	// Sample mask on size x size frequency grid, mask value < 1 means frequency is removed
+	cv::Mat sampled(size, size, CV_64FC1);
+	for (int v = -halo; v <= halo; v++)
+	{
+		for (int u = -halo; u <= halo; u++)
+		{
+			int r = cv::borderInterpolate(mask.rows / 2 + (v * mask.rows) / size, mask.rows, cv::BORDER_REPLICATE);
+			int c = cv::borderInterpolate(mask.cols / 2 + (u * mask.cols) / size, mask.cols, cv::BORDER_REPLICATE);
+			sampled.at<double>(v + halo, u + halo) = mask.at<uchar>(r, c) < 1 ? 0.0 : 1.0;
+		}
+	}
+
+	// Inverse DFT of sampled mask (frequency sampling design), only real part is kept
+	double scale = 1.0 / (size * size);
+	for (int y = -halo; y <= halo; y++)
+	{
+		for (int x = -halo; x <= halo; x++)
+		{
+			double real = 0.0;
+			for (int v = -halo; v <= halo; v++)
+			{
+				for (int u = -halo; u <= halo; u++)
+				{
+					double eVal = 2 * M_PI * ((double)(u * x + v * y) / size);
+					real += sampled.at<double>(v + halo, u + halo) * std::cos(eVal);
+				}
+			}
+			kernel.at<double>(y + halo, x + halo) = real * scale;
+		}
+	}
+
+	return kernel;
+}
+
+// Spectrum of the kernel placed into fftSize x fftSize image with its center at (0, 0)
+static cv::Mat KernelSpectrum(const cv::Mat& kernel, int fftSize)
+{
+	int halo = kernel.rows / 2;
+	cv::Mat padded(fftSize, fftSize, CV_64FC1, cv::Scalar(0.0));
+
+	for (int y = -halo; y <= halo; y++)
+	{
+		for (int x = -halo; x <= halo; x++)
+		{
+			padded.at<double>((y + fftSize) % fftSize, (x + fftSize) % fftSize) = kernel.at<double>(y + halo, x + halo);
+		}
+	}
+
+	cv::Mat spectrum;
+	cv::dft(padded, spectrum, cv::DFT_COMPLEX_OUTPUT);
+	return spectrum;
+}
+
+// Overlap-save filtering of a single channel image by a frequency mask, tile by tile
+// Each tile is fftSize x fftSize, neighbouring tiles overlap by 2 * halo pixels
+// Memory per tile does not depend on image size, tiles are processed in parallel
+// Result is CV_64FC1
+static cv::Mat TiledSpectralFilter(const cv::Mat& original, const cv::Mat& mask, int fftSize = 256, int halo = 16)
+{
+	CV_Assert(original.channels() == 1 && mask.type() == CV_8UC1);
+	CV_Assert(fftSize > 2 * halo);
+
+	cv::Mat result(original.rows, original.cols, CV_64FC1);
+	cv::Mat spectrum = KernelSpectrum(SpectralKernel(mask, halo), fftSize);
+
+	int step = fftSize - 2 * halo;							// Valid output of one tile
+	int tilesX = (original.cols + step - 1) / step;
+	int tilesY = (original.rows + step - 1) / step;
+
+	cv::parallel_for_(cv::Range(0, tilesX * tilesY), [&](const cv::Range& range)
+	{
+		cv::Mat tile, tileSpectrum, filtered;				// Reused by all tiles of this worker
+
+		for (int t = range.start; t < range.end; t++)
+		{
+			cv::Rect core((t % tilesX) * step, (t / tilesX) * step, step, step);
+			core &= cv::Rect(0, 0, original.cols, original.rows);
+
+			// Pixels around the core are taken from the image, outside of the image they are reflected
+			cv::copyMakeBorder(original(core), tile, halo, fftSize - halo - core.height,
+				halo, fftSize - halo - core.width, cv::BORDER_REFLECT_101);
+			tile.convertTo(tile, CV_64FC1);
+
+			cv::dft(tile, tileSpectrum, cv::DFT_COMPLEX_OUTPUT);
+			cv::mulSpectrums(tileSpectrum, spectrum, tileSpectrum, 0);
+			cv::idft(tileSpectrum, filtered, cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+
+			// Circular wrap-around stays in the halo, only the core is valid
+			filtered(cv::Rect(halo, halo, core.width, core.height)).copyTo(result(core));
+		}
+	});
+
+	return result;
+}
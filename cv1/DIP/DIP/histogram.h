@@ -0,0 +1,168 @@
+#pragma once
+#include "stdafx.h"
+#include <mutex>
+
+// Histogram engine, every thread counts its band of the image into private banks which are merged at the end
+// Neighbouring values go to different banks (interleaved), so runs of equal pixels do not wait for the previous increment
+// of the same counter
+
+const int HistogramBanks = 4;
+
+// Counts n values of run taken every stride-th element (weight -1 removes them), value i goes to bank i % 4,
+// all banks may be the same array
+template <typename T, typename Bin>
+static void AccumulateHistogram(const T* run, int n, int* const* banks, Bin bin, int weight = 1, int stride = 1)
+{
+	int* b0 = banks[0];
+	int* b1 = banks[1];
+	int* b2 = banks[2];
+	int* b3 = banks[3];
+
+	int i = 0;
+	for (; i <= n - 4; i += 4, run += 4 * stride)
+	{
+		b0[bin(run[0])] += weight;
+		b1[bin(run[stride])] += weight;
+		b2[bin(run[2 * stride])] += weight;
+		b3[bin(run[3 * stride])] += weight;
+	}
+
+	for (; i < n; i++, run += stride)
+	{
+		b0[bin(run[0])] += weight;
+	}
+}
+
+// Histogram of image with element type T (channel type counts all channels, cv::Vec3b counts whole pixels), bin(value) gives index in <0, bins)
+// With step > 1 only every step-th pixel of every step-th row is counted, T must then be the whole pixel
+// Banks are used only when they fit into cache together (bins <= 4096), otherwise every thread has one array
+template <typename T, typename Bin>
+static void ParallelHistogram(const cv::Mat& image, int* histogram, int bins, Bin bin, int step = 1)
+{
+	CV_Assert(image.depth() == cv::traits::Depth<T>::value && image.channels() % cv::DataType<T>::channels == 0);
+	CV_Assert(step == 1 || (step > 1 && image.type() == cv::traits::Type<T>::value));
+
+	std::fill(histogram, histogram + bins, 0);
+
+	// Continuous image is one run cut into blocks, otherwise rows are counted
+	int rows = (image.rows + step - 1) / step;
+	int n = (image.cols * image.channels() / cv::DataType<T>::channels + step - 1) / step;
+	const int block = 1 << 16;
+	bool flat = image.isContinuous() && step == 1;
+	if (flat)
+	{
+		n *= rows;
+		rows = (n + block - 1) / block;
+	}
+
+	int banks = bins <= 4096 ? HistogramBanks : 1;
+	std::mutex merge;
+
+	cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range& range)
+	{
+		std::vector<int> local(banks * bins, 0);	// Private banks of this thread
+		int* bank[HistogramBanks];
+		for (int b = 0; b < HistogramBanks; b++) { bank[b] = &local[(b % banks) * bins]; }
+
+		for (int r = range.start; r < range.end; r++)
+		{
+			if (flat)
+			{
+				int start = r * block;
+				AccumulateHistogram(image.ptr<T>() + start, std::min(block, n - start), bank, bin);
+			}
+			else AccumulateHistogram(image.ptr<T>(r * step), n, bank, bin, 1, step);
+		}
+
+		for (int b = 1; b < banks; b++)
+		{
+			for (int i = 0; i < bins; i++) { local[i] += local[b * bins + i]; }
+		}
+
+		std::lock_guard<std::mutex> lock(merge);
+		for (int i = 0; i < bins; i++) { histogram[i] += local[i]; }
+	}, cv::getNumThreads());
+}
+
+// Histogram of 8-bit image with 256 bins, all channels are counted together
+static void ComputeHistogram(const cv::Mat& image, int* histogram)
+{
+	ParallelHistogram<uchar>(image, histogram, 256, [](uchar value) { return value; });
+}
+
+// Luma of BGR pixel (BT.601 weights in 14-bit fixed point)
+static inline int Luma(const cv::Vec3b& pixel)
+{
+	return (pixel[0] * 1868 + pixel[1] * 9617 + pixel[2] * 4899 + (1 << 13)) >> 14;
+}
+
+// Histogram of luma of 8-bit BGR image with 256 bins
+static void ComputeLumaHistogram(const cv::Mat& image, int* histogram)
+{
+	CV_Assert(image.type() == CV_8UC3);
+
+	ParallelHistogram<cv::Vec3b>(image, histogram, 256, [](const cv::Vec3b& pixel) { return Luma(pixel); });
+}
+
+// Histograms of all three channels of 8-bit BGR image in one pass, histograms[c] has 256 bins
+// Every band of pixels is read once, its channels are counted with stride 3 while it is in cache
+static void ComputeChannelHistograms(const cv::Mat& image, int* const* histograms)
+{
+	CV_Assert(image.type() == CV_8UC3);
+
+	for (int c = 0; c < 3; c++) { std::fill(histograms[c], histograms[c] + 256, 0); }
+
+	int rows = image.rows;
+	int n = image.cols;		// Pixels in one run
+	const int block = 1 << 16;
+	bool flat = image.isContinuous();
+	if (flat)
+	{
+		n *= rows;
+		rows = (n + block - 1) / block;
+	}
+
+	std::mutex merge;
+
+	cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range& range)
+	{
+		std::vector<int> local(3 * HistogramBanks * 256, 0);	// Private banks of this thread for every channel
+		int* bank[3][HistogramBanks];
+		for (int c = 0; c < 3; c++)
+		{
+			for (int b = 0; b < HistogramBanks; b++) { bank[c][b] = &local[(c * HistogramBanks + b) * 256]; }
+		}
+		auto identity = [](uchar value) { return value; };
+
+		for (int r = range.start; r < range.end; r++)
+		{
+			const uchar* run = flat ? image.ptr<uchar>() + (size_t)r * block * 3 : image.ptr<uchar>(r);
+			int count = flat ? std::min(block, n - r * block) : n;
+
+			for (int c = 0; c < 3; c++) { AccumulateHistogram(run + c, count, bank[c], identity, 1, 3); }
+		}
+
+		std::lock_guard<std::mutex> lock(merge);
+		for (int c = 0; c < 3; c++)
+		{
+			for (int i = 0; i < 256; i++) { histograms[c][i] += bank[c][0][i] + bank[c][1][i] + bank[c][2][i] + bank[c][3][i]; }
+		}
+	}, cv::getNumThreads());
+}
+
+// Histogram of 16-bit image with bins of equal width over <0, 65535>, bins in <1, 65536>
+static void ComputeHistogram16(const cv::Mat& image, int* histogram, int bins)
+{
+	CV_Assert(bins >= 1 && bins <= 65536);
+
+	ParallelHistogram<ushort>(image, histogram, bins, [bins](ushort value) { return (int)(((unsigned)value * (unsigned)bins) >> 16); });
+}
+
+// Histogram of every step-th pixel of every step-th row, for statistics that do not need all pixels
+template <typename T, typename Bin>
+static void SubsampledHistogram(const cv::Mat& image, int* histogram, int bins, int step, Bin bin)
+{
+	CV_Assert(image.type() == cv::traits::Type<T>::value && step >= 1);
+
+	ParallelHistogram<T>(image, histogram, bins, bin, step);
+}
@@ -0,0 +1,300 @@
+#pragma once
+#include "stdafx.h"
+#include "simd.h"
+
+// Median and rank filters of 8-bit images (any number of channels) with (2 * radius + 1)^2 window, borders are replicated
+// 3x3 and 5x5 medians use sorting networks on 16 pixels at once (32 in AVX2 builds), other windows use column histograms
+// (Perreault, Hebert: Median filtering in constant time), the cost per pixel does not depend on radius
+
+static inline uchar MinValue(uchar a, uchar b) { return std::min(a, b); }
+static inline uchar MaxValue(uchar a, uchar b) { return std::max(a, b); }
+
+#if defined(__AVX2__)
+static inline __m256i MinValue(__m256i a, __m256i b) { return _mm256_min_epu8(a, b); }
+static inline __m256i MaxValue(__m256i a, __m256i b) { return _mm256_max_epu8(a, b); }
+#endif
+
+#if defined(DIP_SSE2)
+static inline __m128i MinValue(__m128i a, __m128i b) { return _mm_min_epu8(a, b); }
+static inline __m128i MaxValue(__m128i a, __m128i b) { return _mm_max_epu8(a, b); }
+#endif
+
+// Compare and exchange, a gets the smaller value
+template <typename V> static inline void SortPair(V& a, V& b)
+{
+	V low = MinValue(a, b);
+	b = MaxValue(a, b);
+	a = low;
+}
+
+// Median of 9 values with 19 exchanges
+template <typename V> static inline V NetworkMedian(V (&p)[9])
+{
+	SortPair(p[1], p[2]); SortPair(p[4], p[5]); SortPair(p[7], p[8]);
+	SortPair(p[0], p[1]); SortPair(p[3], p[4]); SortPair(p[6], p[7]);
+	SortPair(p[1], p[2]); SortPair(p[4], p[5]); SortPair(p[7], p[8]);
+	SortPair(p[0], p[3]); SortPair(p[5], p[8]); SortPair(p[4], p[7]);
+	SortPair(p[3], p[6]); SortPair(p[1], p[4]); SortPair(p[2], p[5]);
+	SortPair(p[4], p[7]); SortPair(p[4], p[2]); SortPair(p[6], p[4]);
+	SortPair(p[4], p[2]);
+	return p[4];
+}
+
+// Median of 25 values with 99 exchanges
+template <typename V> static inline V NetworkMedian(V (&p)[25])
+{
+	SortPair(p[0], p[1]);   SortPair(p[3], p[4]);   SortPair(p[2], p[4]);
+	SortPair(p[2], p[3]);   SortPair(p[6], p[7]);   SortPair(p[5], p[7]);
+	SortPair(p[5], p[6]);   SortPair(p[9], p[10]);  SortPair(p[8], p[10]);
+	SortPair(p[8], p[9]);   SortPair(p[12], p[13]); SortPair(p[11], p[13]);
+	SortPair(p[11], p[12]); SortPair(p[15], p[16]); SortPair(p[14], p[16]);
+	SortPair(p[14], p[15]); SortPair(p[18], p[19]); SortPair(p[17], p[19]);
+	SortPair(p[17], p[18]); SortPair(p[21], p[22]); SortPair(p[20], p[22]);
+	SortPair(p[20], p[21]); SortPair(p[23], p[24]); SortPair(p[2], p[5]);
+	SortPair(p[3], p[6]);   SortPair(p[0], p[6]);   SortPair(p[0], p[3]);
+	SortPair(p[4], p[7]);   SortPair(p[1], p[7]);   SortPair(p[1], p[4]);
+	SortPair(p[11], p[14]); SortPair(p[8], p[14]);  SortPair(p[8], p[11]);
+	SortPair(p[12], p[15]); SortPair(p[9], p[15]);  SortPair(p[9], p[12]);
+	SortPair(p[13], p[16]); SortPair(p[10], p[16]); SortPair(p[10], p[13]);
+	SortPair(p[20], p[23]); SortPair(p[17], p[23]); SortPair(p[17], p[20]);
+	SortPair(p[21], p[24]); SortPair(p[18], p[24]); SortPair(p[18], p[21]);
+	SortPair(p[19], p[22]); SortPair(p[8], p[17]);  SortPair(p[9], p[18]);
+	SortPair(p[0], p[18]);  SortPair(p[0], p[9]);   SortPair(p[10], p[19]);
+	SortPair(p[1], p[19]);  SortPair(p[1], p[10]);  SortPair(p[11], p[20]);
+	SortPair(p[2], p[20]);  SortPair(p[2], p[11]);  SortPair(p[12], p[21]);
+	SortPair(p[3], p[21]);  SortPair(p[3], p[12]);  SortPair(p[13], p[22]);
+	SortPair(p[4], p[22]);  SortPair(p[4], p[13]);  SortPair(p[14], p[23]);
+	SortPair(p[5], p[23]);  SortPair(p[5], p[14]);  SortPair(p[15], p[24]);
+	SortPair(p[6], p[24]);  SortPair(p[6], p[15]);  SortPair(p[7], p[16]);
+	SortPair(p[7], p[19]);  SortPair(p[13], p[21]); SortPair(p[15], p[23]);
+	SortPair(p[7], p[13]);  SortPair(p[7], p[15]);  SortPair(p[1], p[9]);
+	SortPair(p[3], p[11]);  SortPair(p[5], p[17]);  SortPair(p[11], p[17]);
+	SortPair(p[9], p[17]);  SortPair(p[4], p[10]);  SortPair(p[6], p[12]);
+	SortPair(p[7], p[14]);  SortPair(p[4], p[6]);   SortPair(p[4], p[7]);
+	SortPair(p[12], p[14]); SortPair(p[10], p[14]); SortPair(p[6], p[7]);
+	SortPair(p[10], p[12]); SortPair(p[6], p[10]);  SortPair(p[6], p[17]);
+	SortPair(p[12], p[17]); SortPair(p[7], p[17]);  SortPair(p[7], p[10]);
+	SortPair(p[12], p[18]); SortPair(p[7], p[12]);  SortPair(p[10], p[18]);
+	SortPair(p[12], p[20]); SortPair(p[10], p[20]); SortPair(p[10], p[12]);
+	return p[12];
+}
+
+// One row of median by sorting network, padded[dy] are the window rows with radius replicated pixels on both sides
+// Values of neighbouring pixels are channels elements apart, so all channels are processed as one run of n values
+template <int Radius> static void NetworkMedianRow(const uchar* const* padded, uchar* out, int n, int channels)
+{
+	const int size = 2 * Radius + 1;
+	int i = 0;
+
+#if defined(__AVX2__)
+	for (; i <= n - 32; i += 32)
+	{
+		__m256i p[size * size];
+		for (int dy = 0; dy < size; dy++)
+		{
+			for (int dx = 0; dx < size; dx++) { p[dy * size + dx] = _mm256_loadu_si256((const __m256i*)(padded[dy] + i + dx * channels)); }
+		}
+		_mm256_storeu_si256((__m256i*)(out + i), NetworkMedian(p));
+	}
+#endif
+
+#if defined(DIP_SSE2)
+	for (; i <= n - 16; i += 16)
+	{
+		__m128i p[size * size];
+		for (int dy = 0; dy < size; dy++)
+		{
+			for (int dx = 0; dx < size; dx++) { p[dy * size + dx] = _mm_loadu_si128((const __m128i*)(padded[dy] + i + dx * channels)); }
+		}
+		_mm_storeu_si128((__m128i*)(out + i), NetworkMedian(p));
+	}
+#endif
+
+	for (; i < n; i++)
+	{
+		uchar p[size * size];
+		for (int dy = 0; dy < size; dy++)
+		{
+			for (int dx = 0; dx < size; dx++) { p[dy * size + dx] = padded[dy][i + dx * channels]; }
+		}
+		out[i] = NetworkMedian(p);
+	}
+}
+
+template <int Radius> static void NetworkMedianFilter(const cv::Mat& src, cv::Mat& dst)
+{
+	const int size = 2 * Radius + 1;
+	int channels = src.channels();
+	int n = src.cols * channels;
+
+	cv::parallel_for_(cv::Range(0, src.rows), [&](const cv::Range& range)
+	{
+		// Window rows with replicated border, refilled for every output row
+		std::vector<uchar> buffer(size * (n + 2 * Radius * channels));
+		const uchar* padded[size];
+
+		for (int y = range.start; y < range.end; y++)
+		{
+			for (int dy = 0; dy < size; dy++)
+			{
+				const uchar* row = src.ptr<uchar>(cv::borderInterpolate(y + dy - Radius, src.rows, cv::BORDER_REPLICATE));
+				uchar* line = &buffer[dy * (n + 2 * Radius * channels)];
+
+				for (int b = 0; b < Radius; b++)
+				{
+					for (int c = 0; c < channels; c++)
+					{
+						line[b * channels + c] = row[c];
+						line[(Radius + src.cols + b) * channels + c] = row[n - channels + c];
+					}
+				}
+				memcpy(line + Radius * channels, row, n);
+				padded[dy] = line;
+			}
+
+			NetworkMedianRow<Radius>(padded, dst.ptr<uchar>(y), n, channels);
+		}
+	});
+}
+
+// Histograms of one column of window (256 fine bins and 16 coarse bins of 16 levels) for every value in a row
+struct ColumnHistograms
+{
+	std::vector<ushort> fine;
+	std::vector<ushort> coarse;
+
+	void Reset(int count)
+	{
+		fine.assign(count * 256, 0);
+		coarse.assign(count * 16, 0);
+	}
+
+	// Adds (weight 1) or removes (weight -1) values of row into histograms of elements <start, end)
+	void Update(const uchar* row, int start, int end, int weight)
+	{
+		for (int i = start; i < end; i++)
+		{
+			fine[(i - start) * 256 + row[i]] += weight;
+			coarse[(i - start) * 16 + (row[i] >> 4)] += weight;
+		}
+	}
+};
+
+// Rank filter of elements <start, end) of every row (one band of columns), histograms cover the band and radius around it
+static void HistogramRankBand(const cv::Mat& src, cv::Mat& dst, int radius, int rank, int start, int end)
+{
+	int channels = src.channels();
+	int n = src.cols * channels;
+
+	// Histograms exist only for columns the band can reach, other columns are replicated border
+	int first = std::max(start - radius * channels, 0);
+	int last = std::min(end + radius * channels, n);
+
+	ColumnHistograms columns;
+	columns.Reset(last - first);
+
+	for (int dy = -radius; dy <= radius; dy++)
+	{
+		columns.Update(src.ptr<uchar>(cv::borderInterpolate(dy, src.rows, cv::BORDER_REPLICATE)), first, last, 1);
+	}
+
+	ushort fine[256], coarse[16];	// Histogram of the window
+
+	for (int y = 0; y < src.rows; y++)
+	{
+		if (y > 0)
+		{
+			// Columns move down by one row
+			columns.Update(src.ptr<uchar>(cv::borderInterpolate(y - radius - 1, src.rows, cv::BORDER_REPLICATE)), first, last, -1);
+			columns.Update(src.ptr<uchar>(cv::borderInterpolate(y + radius, src.rows, cv::BORDER_REPLICATE)), first, last, 1);
+		}
+
+		uchar* out = dst.ptr<uchar>(y);
+
+		// Each channel has its own window sliding over its elements
+		for (int c = 0; c < channels; c++)
+		{
+			int begin = start + ((c - start) % channels + channels) % channels;	// First element of channel c in the band
+			if (begin >= end) continue;
+
+			auto column = [&](int i)	// Histogram index of element i, replicated outside of the image
+			{
+				int x = std::min(std::max(i, c), n - channels + c);
+				return x - first;
+			};
+
+			auto add = [&](int i, int weight)
+			{
+				const ushort* f = &columns.fine[column(i) * 256];
+				const ushort* g = &columns.coarse[column(i) * 16];
+				for (int k = 0; k < 256; k++) { fine[k] += weight * f[k]; }
+				for (int k = 0; k < 16; k++) { coarse[k] += weight * g[k]; }
+			};
+
+			std::fill(fine, fine + 256, 0);
+			std::fill(coarse, coarse + 16, 0);
+			for (int dx = -radius; dx <= radius; dx++) { add(begin + dx * channels, 1); }
+
+			for (int i = begin; i < end; i += channels)
+			{
+				if (i > begin)
+				{
+					// Window moves right by one pixel, one column leaves and one enters
+					add(i - (radius + 1) * channels, -1);
+					add(i + radius * channels, 1);
+				}
+
+				// Coarse bins find the group of 16 levels, fine bins the level inside it
+				int count = 0, group = 0;
+				while (count + coarse[group] <= rank) { count += coarse[group]; group++; }
+
+				int level = group * 16;
+				while (count + fine[level] <= rank) { count += fine[level]; level++; }
+
+				out[i] = (uchar)level;
+			}
+		}
+	}
+}
+
+// rank is relative, 0 gives minimum, 0.5 median and 1 maximum of the window, radius up to 127
+static void RankFilter(const cv::Mat& src, cv::Mat& dst, int radius, double rank)
+{
+	CV_Assert(src.depth() == CV_8U && radius >= 0 && radius <= 127 && rank >= 0 && rank <= 1);
+	CV_Assert(dst.empty() || dst.data != src.data);
+
+	dst.create(src.size(), src.type());
+
+	int size = 2 * radius + 1;
+	int index = (int)(rank * (size * size - 1) + 0.5);	// Position in the sorted window
+	int n = src.cols * src.channels();
+
+	// Bands of columns in parallel, every band slides its own column histograms down the image
+	int width = std::max(n / std::max(cv::getNumThreads(), 1), std::max(64, 2 * size * src.channels()));
+	int bands = (n + width - 1) / width;
+
+	cv::parallel_for_(cv::Range(0, bands), [&](const cv::Range& range)
+	{
+		for (int b = range.start; b < range.end; b++)
+		{
+			HistogramRankBand(src, dst, radius, index, b * width, std::min(n, (b + 1) * width));
+		}
+	});
+}
+
+// dst is created with the type of src, it can not be src
+static void MedianFilter(const cv::Mat& src, cv::Mat& dst, int radius)
+{
+	CV_Assert(src.depth() == CV_8U && radius >= 0);
+	CV_Assert(dst.empty() || dst.data != src.data);
+
+	if (radius == 1 || radius == 2)
+	{
+		dst.create(src.size(), src.type());
+		if (radius == 1) NetworkMedianFilter<1>(src, dst);
+		else NetworkMedianFilter<2>(src, dst);
+		return;
+	}
+
+	RankFilter(src, dst, radius, 0.5);
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include "stdafx.h"
+
+// Loops over pixels with row pointers instead of Mat::at<T>(r, c), the address of every row is computed once
+// and the inner loops are plain pointer loops the compiler can vectorize
+// Continuous images are processed as one flat run of values, row bands can run in parallel
+
+// Splits rows x n values into pieces and calls body(row, start, end) for each of them
+// In parallel the pieces are row bands, a single flat run is cut into blocks
+template <typename Body>
+static void ForEachBand(int rows, int n, bool parallel, Body body)
+{
+	if (!parallel)
+	{
+		for (int r = 0; r < rows; r++) { body(r, 0, n); }
+		return;
+	}
+
+	if (rows > 1)
+	{
+		cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range& range)
+		{
+			for (int r = range.start; r < range.end; r++) { body(r, 0, n); }
+		});
+		return;
+	}
+
+	const int block = 1 << 16;		// Values of one flat run per task
+	int blocks = (n + block - 1) / block;
+	cv::parallel_for_(cv::Range(0, blocks), [&](const cv::Range& range)
+	{
+		for (int b = range.start; b < range.end; b++) { body(0, b * block, std::min(n, (b + 1) * block)); }
+	});
+}
+
+// kernel(const TSrc* src, TDst* dst, int n) on runs of src and dst, dst must have the same size as src
+// TSrc and TDst are element types (uchar for all channels of 8-bit image, cv::Vec3b for whole pixels, ...), dst may be src
+template <typename TSrc, typename TDst, typename Kernel>
+static void ForEachRun(const cv::Mat& src, cv::Mat& dst, Kernel kernel, bool parallel = false)
+{
+	CV_Assert(src.size() == dst.size());
+	CV_Assert(src.elemSize1() == sizeof(TSrc) / cv::DataType<TSrc>::channels && dst.elemSize1() == sizeof(TDst) / cv::DataType<TDst>::channels);
+
+	int rows = src.rows;
+	int n = src.cols * src.channels() / cv::DataType<TSrc>::channels;		// Elements in one row
+	CV_Assert(dst.cols * dst.channels() / cv::DataType<TDst>::channels == n);
+
+	if (src.isContinuous() && dst.isContinuous())
+	{
+		n *= rows;
+		rows = 1;
+	}
+
+	ForEachBand(rows, n, parallel, [&](int r, int start, int end)
+	{
+		kernel(src.ptr<TSrc>(r) + start, dst.ptr<TDst>(r) + start, end - start);
+	});
+}
+
+// dst(x) = op(src(x)), src must be of type TSrc, dst is created as TDst, dst may be src when both types are the same
+template <typename TSrc, typename TDst, typename Op>
+static void ForEachPixel(const cv::Mat& src, cv::Mat& dst, Op op, bool parallel = false)
+{
+	CV_Assert(src.type() == cv::traits::Type<TSrc>::value);
+	dst.create(src.size(), cv::traits::Type<TDst>::value);
+
+	ForEachRun<TSrc, TDst>(src, dst, [&](const TSrc* s, TDst* d, int n)
+	{
+		for (int i = 0; i < n; i++) { d[i] = op(s[i]); }
+	}, parallel);
+}
+
+// kernel(int y, T* row, int cols) for every row of image, for kernels that need pixel coordinates
+template <typename T, typename Kernel>
+static void ForEachRow(cv::Mat& image, Kernel kernel, bool parallel = false)
+{
+	CV_Assert(image.type() == cv::traits::Type<T>::value);
+
+	ForEachBand(image.rows, image.cols, parallel && image.rows > 1, [&](int r, int start, int end)
+	{
+		kernel(r, image.ptr<T>(r), end - start);
+	});
+}
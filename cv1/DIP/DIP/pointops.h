@@ -0,0 +1,423 @@
+#pragma once
+#include "stdafx.h"
+#include "pixelkernel.h"
+#include "dispatch.h"
+#include "fastmath.h"
+#include "histogram.h"
+#include "simd.h"
+
+// Point operations on 8-bit images are compiled to 256 entry look-up tables,
+// the expensive formula is evaluated once per gray level instead of once per pixel
+
+// Table for linear stretch of <oldMin, oldMax> to <newMin, newMax>
+static void GrayCorrectionLut(uchar* lut, double oldMin, double oldMax, double newMin, double newMax)
+{
+	double oldRange = oldMax - oldMin;		// Old range of grayscale
+	double newRange = newMax - newMin;		// New range of grayscale
+
+	for (int i = 0; i < 256; i++)
+	{
+		double value = oldRange > 0 ? (((i - oldMin) * newRange) / oldRange) + newMin : newMin;	// Conversion to a new range
+		lut[i] = (uchar)std::min(std::max(value, 0.0), 255.0);
+	}
+}
+
+// Table for gamma correction
+static void GammaLut(uchar* lut, double gamma)
+{
+	double gammaExp = 1 / gamma;
+
+	for (int i = 0; i < 256; i++)
+	{
+		lut[i] = (uchar)std::min(pow(i / 255.0, gammaExp) * 255, 255.0);	// Gamma correction
+	}
+}
+
+#if defined(DIP_AVX2)
+// Table applied to 32 pixels at once, indices are widened to 32 bits for hardware gather and packed back
+// Returns number of values done, the rest is left to the scalar loop
+DIP_AVX2_TARGET static int ApplyLutAvx2(const uchar* src, uchar* dst, int n, const int* lut32)
+{
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	int i = 0;
+
+	for (; i <= n - 32; i += 32)
+	{
+		__m256i a = _mm256_i32gather_epi32(lut32, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i))), 4);
+		__m256i b = _mm256_i32gather_epi32(lut32, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i + 8))), 4);
+		__m256i c = _mm256_i32gather_epi32(lut32, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i + 16))), 4);
+		__m256i d = _mm256_i32gather_epi32(lut32, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i + 24))), 4);
+
+		__m256i packed = _mm256_packus_epi16(_mm256_packus_epi32(a, b), _mm256_packus_epi32(c, d));	// Packing works inside 128-bit lanes
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_permutevar8x32_epi32(packed, order));
+	}
+
+	return i;
+}
+#endif
+
+// Apply table to a run of n values, lut32 is the same table widened to 32 bits for the AVX2 gather
+// lut32 is given only when HasAvx2(), null selects the scalar loop
+static void ApplyLut(const uchar* src, uchar* dst, int n, const uchar* lut, const int* lut32)
+{
+	int i = 0;
+
+#if defined(DIP_AVX2)
+	if (lut32) i = ApplyLutAvx2(src, dst, n, lut32);
+#else
+	(void)lut32;
+#endif
+
+	// Four independent loads per iteration
+	for (; i <= n - 4; i += 4)
+	{
+		uchar v0 = lut[src[i]];
+		uchar v1 = lut[src[i + 1]];
+		uchar v2 = lut[src[i + 2]];
+		uchar v3 = lut[src[i + 3]];
+		dst[i] = v0;
+		dst[i + 1] = v1;
+		dst[i + 2] = v2;
+		dst[i + 3] = v3;
+	}
+
+	for (; i < n; i++)
+	{
+		dst[i] = lut[src[i]];
+	}
+}
+
+// dst(x) = lut[src(x)] for every channel of 8-bit image, dst may be the same image as src
+static void ApplyLut(const cv::Mat& src, cv::Mat& dst, const uchar* lut)
+{
+	CV_Assert(src.depth() == CV_8U);
+
+	dst.create(src.size(), src.type());
+
+	int lut32[256];		// Gather works on 32-bit lanes
+	bool gather = HasAvx2();
+	if (gather)
+	{
+		for (int i = 0; i < 256; i++) { lut32[i] = lut[i]; }
+	}
+
+	ForEachRun<uchar, uchar>(src, dst, [&](const uchar* s, uchar* d, int n)
+	{
+		ApplyLut(s, d, n, lut, gather ? lut32 : nullptr);
+	}, true);
+}
+
+// Runs of values at depths without tables: 16-bit (65536 entries would not fit into L1 cache) and floating point
+// Double precision is computed exactly, 16-bit and float images in single precision with FastPow, so the loops vectorize
+
+// d = s * scale + shift
+template <typename T> static void StretchRun(const T* s, T* d, int n, double scale, double shift)
+{
+	for (int i = 0; i < n; i++) { d[i] = cv::saturate_cast<T>(s[i] * scale + shift); }
+}
+
+static void StretchRun(const float* s, float* d, int n, double scale, double shift)
+{
+	float a = (float)scale, b = (float)shift;
+	for (int i = 0; i < n; i++) { d[i] = s[i] * a + b; }
+}
+
+static void StretchRun(const ushort* s, ushort* d, int n, double scale, double shift)
+{
+	float a = (float)scale, b = (float)shift + 0.5f;		// Rounding to nearest
+	for (int i = 0; i < n; i++) { d[i] = (ushort)std::min(std::max(s[i] * a + b, 0.0f), 65535.0f); }
+}
+
+// d = full * (s / full)^gammaExp
+template <typename T> static void GammaRun(const T* s, T* d, int n, double gammaExp, double full)
+{
+	for (int i = 0; i < n; i++) { d[i] = cv::saturate_cast<T>(pow(std::max(s[i] / full, 0.0), gammaExp) * full); }
+}
+
+// Relative error below 7e-6 for gamma in <0.1, 10>, below 1e-6 for gamma >= 1
+static void GammaRun(const float* s, float* d, int n, double gammaExp, double)
+{
+	float e = (float)gammaExp;
+	for (int i = 0; i < n; i++) { d[i] = FastPow(s[i], e); }
+}
+
+// Result differs from exact rounding by at most one level
+static void GammaRun(const ushort* s, ushort* d, int n, double gammaExp, double full)
+{
+	float e = (float)gammaExp;
+	float inv = (float)(1 / full), scale = (float)full;
+	for (int i = 0; i < n; i++) { d[i] = (ushort)std::min(FastPow(s[i] * inv, e) * scale + 0.5f, 65535.0f); }
+}
+
+// Linear stretch of <oldMin, oldMax> to <newMin, newMax> computed directly at depth T
+template <typename T> static void GrayCorrectionDirect(const cv::Mat& src, cv::Mat& dst, double oldMin, double oldMax, double newMin, double newMax)
+{
+	double oldRange = oldMax - oldMin;
+	double scale = oldRange > 0 ? (newMax - newMin) / oldRange : 0.0;
+	double shift = newMin - oldMin * scale;
+
+	dst.create(src.size(), src.type());
+	ForEachRun<T, T>(src, dst, [&](const T* s, T* d, int n)
+	{
+		StretchRun(s, d, n, scale, shift);
+	}, true);
+}
+
+// Gamma correction at depth T, values are normalized by the full scale of T (65535 for 16-bit, 1 for floating point)
+template <typename T> static void GammaDirect(const cv::Mat& src, cv::Mat& dst, double gamma)
+{
+	double gammaExp = 1 / gamma;
+	double full = PixelRange<T>::Max();
+
+	dst.create(src.size(), src.type());
+	ForEachRun<T, T>(src, dst, [&](const T* s, T* d, int n)
+	{
+		GammaRun(s, d, n, gammaExp, full);
+	}, true);
+}
+
+// Table for histogram equalization of image with total pixels, cdf is a running prefix sum
+// lut(i) = (cdf(i) - cdfMin) / (total - cdfMin) * 255, where cdfMin is cdf of the first non empty bin
+static void EqualizationLut(const int* histogram, int total, uchar* lut)
+{
+	int cdf = 0;
+	int cdfMin = -1;	// cdf of the first non empty bin
+
+	for (int i = 0; i < 256; i++)
+	{
+		cdf += histogram[i];
+		if (cdfMin < 0 && cdf > 0) cdfMin = cdf;
+
+		float value = cdf > 0 && total > cdfMin ? ((float)(cdf - cdfMin) / (total - cdfMin)) * 255 : 0.0f;
+		lut[i] = (uchar)value;
+	}
+}
+
+// Cumulative counts of reference histogram for histogram specification, kept so that the reference is summed only once
+struct ReferenceCdf
+{
+	int64_t cdf[256];
+	int64_t total;
+};
+
+static void BuildReferenceCdf(const int* histogram, ReferenceCdf& reference)
+{
+	int64_t cdf = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		cdf += histogram[i];
+		reference.cdf[i] = cdf;
+	}
+	reference.total = cdf;
+}
+
+// Table for histogram specification, level i goes to the first reference level whose cdf reaches cdf(i) (inverse cdf)
+// Both cdfs only grow, so one pass over both is enough, relative cdfs are compared in integers
+static void SpecificationLut(const int* histogram, const ReferenceCdf& reference, uchar* lut)
+{
+	int64_t total = 0;
+	for (int i = 0; i < 256; i++) { total += histogram[i]; }
+
+	int64_t cdf = 0;
+	int j = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		cdf += histogram[i];
+		while (j < 255 && reference.cdf[j] * total < cdf * reference.total) j++;
+		lut[i] = (uchar)j;
+	}
+}
+
+static void SpecificationLut(const int* histogram, const int* referenceHistogram, uchar* lut)
+{
+	ReferenceCdf reference;
+	BuildReferenceCdf(referenceHistogram, reference);
+	SpecificationLut(histogram, reference, lut);
+}
+
+// Applies its own table to every channel of 8-bit BGR image, luts are 3 x 256 values, dst may be the same image as src
+static void ApplyChannelLuts(const cv::Mat& src, cv::Mat& dst, const uchar* luts)
+{
+	CV_Assert(src.type() == CV_8UC3);
+
+	ForEachPixel<cv::Vec3b, cv::Vec3b>(src, dst, [&](const cv::Vec3b& pixel)
+	{
+		return cv::Vec3b(luts[pixel[0]], luts[256 + pixel[1]], luts[512 + pixel[2]]);
+	}, true);
+}
+
+// Applies table to luma of 8-bit BGR image, the change of luma is added to all three channels, so chroma (B - Y, R - Y) is kept
+// dst may be the same image as src
+static void ApplyLumaLut(const cv::Mat& src, cv::Mat& dst, const uchar* lut)
+{
+	CV_Assert(src.type() == CV_8UC3);
+
+	int delta[256];		// Change of luma
+	for (int i = 0; i < 256; i++) { delta[i] = lut[i] - i; }
+
+	ForEachPixel<cv::Vec3b, cv::Vec3b>(src, dst, [&](const cv::Vec3b& pixel)
+	{
+		int d = delta[Luma(pixel)];
+		return cv::Vec3b(cv::saturate_cast<uchar>(pixel[0] + d), cv::saturate_cast<uchar>(pixel[1] + d), cv::saturate_cast<uchar>(pixel[2] + d));
+	}, true);
+}
+
+// Chain of point operations that is evaluated lazily
+// 8-bit images: all stages are composed into a single table, data dependent stages (gray correction, equalization)
+// take their statistics from the source histogram mapped through the stages before them,
+// so the source is read once for the histogram (only if needed) and once for the result
+// Equalization is only for gray images, BGR images are equalized by luma (EqualizeHistogram), which is not a per channel table
+// 32-bit float images: stages run one after another on a short run of pixels while it is in cache, runs in parallel,
+// min and max are propagated through the stages (all of them are monotonic), equalization is not available
+class PointPipeline
+{
+public:
+	PointPipeline& GrayCorrection(double newMin, double newMax) { stages.push_back({ Operation::GrayCorrection, newMin, newMax }); return *this; }
+	PointPipeline& Gamma(double gamma) { stages.push_back({ Operation::Gamma, gamma, 0.0 }); return *this; }
+	PointPipeline& Equalize() { stages.push_back({ Operation::Equalize, 0.0, 0.0 }); return *this; }
+
+	// Single table equal to all stages applied to src, only for 8-bit images
+	void Compile(const cv::Mat& src, uchar* lut) const
+	{
+		CV_Assert(src.depth() == CV_8U);
+
+		for (const Stage& stage : stages)
+		{
+			if (stage.operation == Operation::Equalize) CV_Assert(src.channels() == 1);
+		}
+
+		for (int i = 0; i < 256; i++) { lut[i] = (uchar)i; }
+
+		int histogram[256] = { 0 };		// Histogram of the source, only when some stage needs it
+		if (NeedsStatistics())
+		{
+			ComputeHistogram(src, histogram);
+		}
+
+		for (const Stage& stage : stages)
+		{
+			uchar stageLut[256];
+
+			if (stage.operation == Operation::Gamma)
+			{
+				GammaLut(stageLut, stage.a);
+			}
+			else
+			{
+				// Histogram of the image as it enters this stage
+				int current[256] = { 0 };
+				for (int i = 0; i < 256; i++) { current[lut[i]] += histogram[i]; }
+
+				if (stage.operation == Operation::Equalize)
+				{
+					EqualizationLut(current, (int)src.total() * src.channels(), stageLut);
+				}
+				else
+				{
+					int oldMin = 0, oldMax = 255;
+					while (oldMin < 255 && current[oldMin] == 0) oldMin++;
+					while (oldMax > 0 && current[oldMax] == 0) oldMax--;
+					GrayCorrectionLut(stageLut, oldMin, oldMax, stage.a, stage.b);
+				}
+			}
+
+			for (int i = 0; i < 256; i++) { lut[i] = stageLut[lut[i]]; }	// Composition of tables
+		}
+	}
+
+	// Evaluates all stages in one pass, dst may be the same image as src
+	void Apply(const cv::Mat& src, cv::Mat& dst) const
+	{
+		if (src.depth() == CV_8U)
+		{
+			uchar lut[256];
+			Compile(src, lut);
+			ApplyLut(src, dst, lut);
+			return;
+		}
+
+		CV_Assert(src.depth() == CV_32F);
+
+		// Range of values entering every stage
+		double oldMin = 0.0, oldMax = 0.0;
+		if (NeedsStatistics()) cv::minMaxLoc(src.reshape(1), &oldMin, &oldMax);
+
+		std::vector<float> scale(stages.size()), shift(stages.size());
+		for (size_t s = 0; s < stages.size(); s++)
+		{
+			const Stage& stage = stages[s];
+			CV_Assert(stage.operation != Operation::Equalize);
+
+			if (stage.operation == Operation::GrayCorrection)
+			{
+				double oldRange = oldMax - oldMin;
+				scale[s] = (float)(oldRange > 0 ? (stage.b - stage.a) / oldRange : 0.0);
+				shift[s] = (float)(stage.a - oldMin * scale[s]);
+				oldMin = stage.a;
+				oldMax = oldRange > 0 ? stage.b : stage.a;
+			}
+			else
+			{
+				scale[s] = (float)(1 / stage.a);
+				oldMin = pow(std::max(oldMin, 0.0), scale[s]);
+				oldMax = pow(std::max(oldMax, 0.0), scale[s]);
+			}
+		}
+
+		dst.create(src.size(), src.type());
+
+		const int chunk = 4096;		// Values that stay in L1 cache between stages
+
+		ForEachRun<float, float>(src, dst, [&](const float* run, float* result, int n)
+		{
+			for (int start = 0; start < n; start += chunk)
+			{
+				int count = std::min(chunk, n - start);
+				const float* in = run + start;
+				float* out = result + start;
+
+				if (stages.empty() && in != out) memcpy(out, in, count * sizeof(float));
+
+				for (size_t s = 0; s < stages.size(); s++)
+				{
+					const float* from = s == 0 ? in : out;	// First stage reads source, others work in place
+					float a = scale[s], b = shift[s];
+
+					if (stages[s].operation == Operation::GrayCorrection)
+					{
+						for (int i = 0; i < count; i++) { out[i] = from[i] * a + b; }
+					}
+					else
+					{
+						for (int i = 0; i < count; i++) { out[i] = FastPow(from[i], a); }
+					}
+				}
+			}
+		}, true);
+	}
+
+private:
+	enum class Operation
+	{
+		GrayCorrection,
+		Gamma,
+		Equalize
+	};
+
+	struct Stage
+	{
+		Operation operation;
+		double a, b;		// Parameters of the operation
+	};
+
+	bool NeedsStatistics() const
+	{
+		for (const Stage& stage : stages)
+		{
+			if (stage.operation != Operation::Gamma) return true;
+		}
+		return false;
+	}
+
+	std::vector<Stage> stages;
+};
@@ -0,0 +1,486 @@
+#pragma once
+#include "stdafx.h"
+#include "dispatch.h"
+#include "simd.h"
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <type_traits>
+
+// Geometric transformations as maps: for every destination pixel the source position (column, row) it is taken from
+// The map depends only on the transformation, it is built once and every image is then only a gather and blend pass
+
+// Borders of remapped images, pixels mapped outside of the source are black, take the nearest pixel of the source
+// or keep what dst already contains
+enum class RemapBorder
+{
+	Constant,
+	Replicate,
+	Transparent
+};
+
+// body(y, start, end) over tiles of an image of size, bands of tile rows run in parallel and tiles of a band left to right,
+// positions mapped from one tile lie close together in the source, so its lines are still in cache for the next row of the tile
+const int RemapTileRows = 16;
+const int RemapTileCols = 64;
+
+template <typename Body> static void ForEachTile(cv::Size size, Body body)
+{
+	int bands = (size.height + RemapTileRows - 1) / RemapTileRows;
+
+	cv::parallel_for_(cv::Range(0, bands), [&](const cv::Range& range)
+	{
+		for (int band = range.start; band < range.end; band++)
+		{
+			int y0 = band * RemapTileRows;
+			int y1 = std::min(y0 + RemapTileRows, size.height);
+
+			for (int x0 = 0; x0 < size.width; x0 += RemapTileCols)
+			{
+				int x1 = std::min(x0 + RemapTileCols, size.width);
+				for (int y = y0; y < y1; y++) { body(y, x0, x1); }
+			}
+		}
+	});
+}
+
+// dst(p) = bilinear interpolation of src at map(p), map is CV_32FC2 of dst size, C is the channel type of src (any number of channels)
+// Positions are clamped to the image, the border decides only the weight of pixels mapped outside (1 or 0), except Transparent,
+// which requires dst of the map size and src type and skips them, NaN positions are black (or skipped) with every border
+// Blending is in float, double images are blended in double
+template <typename C> static void RemapBilinear(const cv::Mat& src, cv::Mat& dst, const cv::Mat& map, RemapBorder border = RemapBorder::Constant)
+{
+	typedef typename std::conditional<std::is_same<C, double>::value, double, float>::type W;
+
+	CV_Assert(map.type() == CV_32FC2 && src.depth() == cv::traits::Depth<C>::value);
+	CV_Assert(dst.empty() || dst.data != src.data);
+
+	if (border == RemapBorder::Transparent) CV_Assert(dst.size() == map.size() && dst.type() == src.type());
+	dst.create(map.size(), src.type());
+
+	int channels = src.channels();
+	W maxX = (W)(src.cols - 1), maxY = (W)(src.rows - 1);
+	int lastX = std::max(src.cols - 2, 0), lastY = std::max(src.rows - 2, 0);	// Last top left neighbour
+	int right = src.cols > 1 ? channels : 0;
+	size_t down = src.rows > 1 ? src.step[0] : 0;
+
+	ForEachTile(dst.size(), [&](int y, int start, int end)
+	{
+		const cv::Vec2f* position = map.ptr<cv::Vec2f>(y);
+		C* out = dst.ptr<C>(y);
+
+		for (int x = start; x < end; x++)
+		{
+			W sx = position[x][0];
+			W sy = position[x][1];
+
+			bool inside = sx >= 0 && sx < src.cols && sy >= 0 && sy < src.rows;
+			bool missing = std::isnan(sx) || std::isnan(sy);	// No source pixel at all (outside of an intermediate image of WarpChain)
+			if (border == RemapBorder::Transparent && !inside) continue;
+			W scale = (border == RemapBorder::Constant && !inside) || missing ? (W)0 : (W)1;
+
+			// Last row and column are interpolated from the previous one with weight 1
+			sx = std::min(std::max((W)0, sx), maxX);
+			sy = std::min(std::max((W)0, sy), maxY);
+			int x0 = std::min((int)sx, lastX), y0 = std::min((int)sy, lastY);
+			W fx = sx - x0, fy = sy - y0;
+
+			const C* top = src.ptr<C>(y0) + x0 * channels;
+			const C* bottom = (const C*)((const uchar*)top + down);
+			C* pixel = out + x * channels;
+
+			for (int c = 0; c < channels; c++)
+			{
+				W upper = top[c] + (top[c + right] - top[c]) * fx;
+				W lower = bottom[c] + (bottom[c + right] - bottom[c]) * fx;
+				pixel[c] = cv::saturate_cast<C>((upper + (lower - upper) * fy) * scale);
+			}
+		}
+	});
+}
+
+// Fixed point maps for 8-bit images: integer position of the top left neighbour and index of the fraction pair
+// Fractions have 5 bits, both 0 and 1 (32/32) are kept, so a position on the last row or column is stored
+// as the previous one with fraction 1 and all four neighbours are always inside the image
+const int RemapFractionBits = 5;
+const int RemapSteps = 1 << RemapFractionBits;
+const int RemapFractions = RemapSteps + 1;
+const int RemapOutside = RemapFractions * RemapFractions;	// Index of zero weights, pixel is outside of the image
+const int RemapWeightBits = 2 * RemapFractionBits;			// Weights of one pixel sum to 1 << RemapWeightBits
+
+struct FixedMap
+{
+	cv::Mat position;	// CV_16SC2, (column, row) of the top left neighbour
+	cv::Mat fraction;	// CV_16UC1, index into RemapWeights, RemapOutside for pixels outside of the source
+};
+
+// Weights of the four neighbours (top left, top right, bottom left, bottom right) for every fraction pair
+static const short* RemapWeights()
+{
+	static const std::vector<short> table = []
+	{
+		std::vector<short> weights((RemapOutside + 1) * 4, 0);
+		for (int fy = 0; fy < RemapFractions; fy++)
+		{
+			for (int fx = 0; fx < RemapFractions; fx++)
+			{
+				short* w = &weights[(fy * RemapFractions + fx) * 4];
+				w[0] = (short)((RemapSteps - fx) * (RemapSteps - fy));
+				w[1] = (short)(fx * (RemapSteps - fy));
+				w[2] = (short)((RemapSteps - fx) * fy);
+				w[3] = (short)(fx * fy);
+			}
+		}
+		return weights;
+	}();
+	return table.data();
+}
+
+// Integer position and fraction index of coordinate in <0, size), size >= 2
+static inline void FixedCoordinate(float coordinate, int size, int& position, int& fraction)
+{
+	position = (int)coordinate;
+	fraction = cvRound((coordinate - position) * RemapSteps);
+	if (fraction == RemapSteps)
+	{
+		position++;
+		fraction = 0;
+	}
+	if (position >= size - 1)	// Last pixel is the right neighbour with full weight
+	{
+		position = size - 2;
+		fraction = RemapSteps;
+	}
+}
+
+// Converts CV_32FC2 map into fixed point map for source of srcSize (at least 2x2 pixels, at most 32767 in both directions)
+// With Replicate border positions outside are clamped to the image, otherwise they are marked as RemapOutside, NaN always is
+static void ConvertToFixedMap(const cv::Mat& map, cv::Size srcSize, FixedMap& fixed, RemapBorder border = RemapBorder::Constant)
+{
+	CV_Assert(map.type() == CV_32FC2);
+	CV_Assert(srcSize.width >= 2 && srcSize.height >= 2 && srcSize.width <= SHRT_MAX && srcSize.height <= SHRT_MAX);
+
+	fixed.position.create(map.size(), CV_16SC2);
+	fixed.fraction.create(map.size(), CV_16UC1);
+
+	cv::parallel_for_(cv::Range(0, map.rows), [&](const cv::Range& range)
+	{
+		for (int y = range.start; y < range.end; y++)
+		{
+			const cv::Vec2f* in = map.ptr<cv::Vec2f>(y);
+			cv::Vec2s* position = fixed.position.ptr<cv::Vec2s>(y);
+			ushort* fraction = fixed.fraction.ptr<ushort>(y);
+
+			for (int x = 0; x < map.cols; x++)
+			{
+				float sx = in[x][0];
+				float sy = in[x][1];
+
+				if (std::isnan(sx) || std::isnan(sy))
+				{
+					position[x] = cv::Vec2s(0, 0);
+					fraction[x] = RemapOutside;		// No source pixel with any border
+					continue;
+				}
+
+				if (border == RemapBorder::Replicate)
+				{
+					sx = std::min(std::max(0.0f, sx), (float)(srcSize.width - 1));
+					sy = std::min(std::max(0.0f, sy), (float)(srcSize.height - 1));
+				}
+				else if (!(sx >= 0 && sx < srcSize.width && sy >= 0 && sy < srcSize.height))
+				{
+					position[x] = cv::Vec2s(0, 0);
+					fraction[x] = RemapOutside;
+					continue;
+				}
+
+				int px, py, fx, fy;
+				FixedCoordinate(sx, srcSize.width, px, fx);
+				FixedCoordinate(sy, srcSize.height, py, fy);
+				position[x] = cv::Vec2s((short)px, (short)py);
+				fraction[x] = (ushort)(fy * RemapFractions + fx);
+			}
+		}
+	});
+}
+
+#if defined(DIP_SSE2)
+// Two neighbouring BGR pixels as 16-bit values ordered by channel: b0 b1 g0 g1 r0 r1
+static inline __m128i LoadPixelPair(const uchar* p)
+{
+	int low;
+	short high;
+	memcpy(&low, p, sizeof(low));
+	memcpy(&high, p + 4, sizeof(high));
+	__m128i wide = _mm_unpacklo_epi8(_mm_insert_epi16(_mm_cvtsi32_si128(low), high, 2), _mm_setzero_si128());	// b0 g0 r0 b1 g1 r1
+	return _mm_unpacklo_epi16(wide, _mm_srli_si128(wide, 6));
+}
+#endif
+
+// Bilinear blend of one pixel with integer weights, Channels is 1 or 3
+template <int Channels> static inline void BlendFixed(const uchar* top, const uchar* bottom, const short* w, uchar* out)
+{
+	const int half = 1 << (RemapWeightBits - 1);
+
+#if defined(DIP_SSE2)
+	if (Channels == 3)
+	{
+		// Pairs of neighbours times pairs of weights, all three channels at once
+		int upper, lower;
+		memcpy(&upper, w, sizeof(upper));
+		memcpy(&lower, w + 2, sizeof(lower));
+		__m128i sum = _mm_add_epi32(_mm_madd_epi16(LoadPixelPair(top), _mm_set1_epi32(upper)), _mm_madd_epi16(LoadPixelPair(bottom), _mm_set1_epi32(lower)));
+		sum = _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(half)), RemapWeightBits);
+		__m128i packed = _mm_packus_epi16(_mm_packs_epi32(sum, sum), sum);
+		int bgr = _mm_cvtsi128_si32(packed);
+		memcpy(out, &bgr, 3);
+		return;
+	}
+#endif
+
+	for (int c = 0; c < Channels; c++)
+	{
+		int sum = top[c] * w[0] + top[c + Channels] * w[1] + bottom[c] * w[2] + bottom[c + Channels] * w[3];
+		out[c] = (uchar)((sum + half) >> RemapWeightBits);
+	}
+}
+
+template <int Channels> static void RemapFixedKernel(const cv::Mat& src, cv::Mat& dst, const FixedMap& map, RemapBorder border)
+{
+	const short* weights = RemapWeights();
+
+	ForEachTile(dst.size(), [&](int y, int start, int end)
+	{
+		const cv::Vec2s* position = map.position.ptr<cv::Vec2s>(y);
+		const ushort* fraction = map.fraction.ptr<ushort>(y);
+		uchar* out = dst.ptr<uchar>(y);
+
+		for (int x = start; x < end; x++)
+		{
+			if (border == RemapBorder::Transparent && fraction[x] == RemapOutside) continue;
+
+			const uchar* top = src.ptr<uchar>(position[x][1]) + position[x][0] * Channels;
+			BlendFixed<Channels>(top, top + src.step[0], weights + fraction[x] * 4, out + x * Channels);
+		}
+	});
+}
+
+// dst(p) = bilinear interpolation of src at fixed point map(p), src is CV_8UC1 or CV_8UC3 of the size the map was converted for
+// With Transparent border dst must already have the map size and src type, otherwise it is created
+// Replicate border needs the map converted with Replicate, such map has pixels outside only where it was NaN (they are black)
+static void RemapFixed(const cv::Mat& src, cv::Mat& dst, const FixedMap& map, RemapBorder border = RemapBorder::Constant)
+{
+	CV_Assert(src.type() == CV_8UC1 || src.type() == CV_8UC3);
+	CV_Assert(map.position.type() == CV_16SC2 && map.fraction.type() == CV_16UC1 && map.position.size() == map.fraction.size());
+	CV_Assert(dst.empty() || dst.data != src.data);
+
+	if (border == RemapBorder::Transparent) CV_Assert(dst.size() == map.position.size() && dst.type() == src.type());
+	dst.create(map.position.size(), src.type());
+
+	if (src.channels() == 1) RemapFixedKernel<1>(src, dst, map, border);
+	else RemapFixedKernel<3>(src, dst, map, border);
+}
+
+// Resamples one image through map, 8-bit gray and color images go through the fixed point map and integer interpolation
+// The fixed point map is converted on every call, for frames of a video convert it once (BuildFixedMap) and call RemapFixed
+static void Remap(const cv::Mat& src, cv::Mat& dst, const cv::Mat& map, RemapBorder border = RemapBorder::Constant)
+{
+	if ((src.type() == CV_8UC1 || src.type() == CV_8UC3) && src.rows >= 2 && src.cols >= 2)
+	{
+		FixedMap fixed;
+		ConvertToFixedMap(map, src.size(), fixed, border);
+		RemapFixed(src, dst, fixed, border);
+		return;
+	}
+
+	DispatchDepth(src.depth(), [&](auto value)
+	{
+		RemapBilinear<decltype(value)>(src, dst, map, border);
+	});
+}
+
+// Chain of geometric stages (undistortion, perspective, resize, ...) composed into one map from the final image to the original,
+// so the original is interpolated only once, instead of once per stage with blur and cost added by every resample
+// Stages are added in the order they are applied to the image, every stage gives for a position (column, row) in its output
+// the position in its input, positions outside of the input of any stage are outside of the whole chain
+class WarpChain
+{
+public:
+	typedef std::function<void(cv::Point2d& position)> Inverse;
+
+	// size of the original image
+	WarpChain(cv::Size size) : source(size), size(size) {}
+
+	// Size of the image after all stages added so far
+	cv::Size Size() const { return size; }
+
+	// General stage with output of outSize
+	WarpChain& Stage(cv::Size outSize, Inverse inverse)
+	{
+		stages.push_back({ size, inverse });
+		size = outSize;
+		return *this;
+	}
+
+	// h maps homogenous output position (column, row, 1) to the input
+	WarpChain& Homography(const cv::Matx33d& h, cv::Size outSize)
+	{
+		return Stage(outSize, [h](cv::Point2d& position)
+		{
+			cv::Vec3d p = h * cv::Vec3d(position.x, position.y, 1.0);
+			position = cv::Point2d(p[0] / p[2], p[1] / p[2]);
+		});
+	}
+
+	// Scales the image to outSize, pixel centers are aligned and borders are replicated
+	WarpChain& Resize(cv::Size outSize)
+	{
+		CV_Assert(outSize.width > 0 && outSize.height > 0);
+
+		double sx = (double)size.width / outSize.width;
+		double sy = (double)size.height / outSize.height;
+		double maxX = size.width - 1, maxY = size.height - 1;
+
+		return Stage(outSize, [=](cv::Point2d& position)
+		{
+			position.x = std::min(std::max((position.x + 0.5) * sx - 0.5, 0.0), maxX);
+			position.y = std::min(std::max((position.y + 0.5) * sy - 0.5, 0.0), maxY);
+		});
+	}
+
+	// Stage given by its own CV_32FC2 map (its output has the map size), positions are interpolated between map pixels
+	WarpChain& Map(const cv::Mat& map)
+	{
+		CV_Assert(map.type() == CV_32FC2);
+
+		return Stage(map.size(), [map](cv::Point2d& position)
+		{
+			position = MapPosition(map, position);
+		});
+	}
+
+	// Composed CV_32FC2 map of the final image for remapping with border, positions in the original are left to the remap
+	// Positions outside of an intermediate image are clamped to it with Replicate border (its nearest pixel, as if the stages
+	// were applied one by one), with other borders they are NaN, which every remap treats as a pixel without source
+	void BuildMap(cv::Mat& map, RemapBorder border = RemapBorder::Constant) const
+	{
+		map.create(size, CV_32FC2);
+
+		const double none = std::numeric_limits<double>::quiet_NaN();
+
+		cv::parallel_for_(cv::Range(0, map.rows), [&](const cv::Range& range)
+		{
+			for (int y = range.start; y < range.end; y++)
+			{
+				cv::Vec2f* row = map.ptr<cv::Vec2f>(y);
+
+				for (int x = 0; x < map.cols; x++)
+				{
+					cv::Point2d position(x, y);
+
+					// From the last stage back to the original
+					for (size_t s = stages.size(); s-- > 0;)
+					{
+						stages[s].inverse(position);
+						if (s == 0) break;
+
+						const cv::Size& input = stages[s].input;
+						if (border == RemapBorder::Replicate)
+						{
+							position.x = std::min(std::max(0.0, position.x), input.width - 1.0);
+							position.y = std::min(std::max(0.0, position.y), input.height - 1.0);
+						}
+						else if (!(position.x >= 0 && position.x < input.width && position.y >= 0 && position.y < input.height))
+						{
+							position = cv::Point2d(none, none);
+							break;
+						}
+					}
+
+					row[x] = cv::Vec2f((float)position.x, (float)position.y);
+				}
+			}
+		});
+	}
+
+	// Composed map converted once to the fixed point form for 8-bit images, every frame is then only RemapFixed
+	void BuildFixedMap(FixedMap& fixed, RemapBorder border = RemapBorder::Constant) const
+	{
+		cv::Mat map;
+		BuildMap(map, border);
+		ConvertToFixedMap(map, source, fixed, border);
+	}
+
+private:
+	// Bilinear interpolation of map at position, which is clamped to the map (BuildMap passes only positions inside)
+	static cv::Point2d MapPosition(const cv::Mat& map, cv::Point2d position)
+	{
+		position.x = std::min(std::max(0.0, position.x), map.cols - 1.0);
+		position.y = std::min(std::max(0.0, position.y), map.rows - 1.0);
+
+		int x0 = std::min((int)position.x, std::max(map.cols - 2, 0));
+		int y0 = std::min((int)position.y, std::max(map.rows - 2, 0));
+		int x1 = std::min(x0 + 1, map.cols - 1);
+		int y1 = std::min(y0 + 1, map.rows - 1);
+		double fx = position.x - x0, fy = position.y - y0;
+
+		cv::Vec2f p[4] = { map.at<cv::Vec2f>(y0, x0), map.at<cv::Vec2f>(y0, x1), map.at<cv::Vec2f>(y1, x0), map.at<cv::Vec2f>(y1, x1) };
+
+		return cv::Point2d(
+			(p[0][0] * (1 - fx) + p[1][0] * fx) * (1 - fy) + (p[2][0] * (1 - fx) + p[3][0] * fx) * fy,
+			(p[0][1] * (1 - fx) + p[1][1] * fx) * (1 - fy) + (p[2][1] * (1 - fx) + p[3][1] * fx) * fy);
+	}
+
+	struct Transform
+	{
+		cv::Size input;
+		Inverse inverse;
+	};
+
+	cv::Size source;	// Size of the original image
+	cv::Size size;
+	std::vector<Transform> stages;
+};
+
+// Last few maps keyed by the parameters they were built from, the least recently used one is dropped
+// Key needs operator ==, maps are shared (cv::Mat reference counting), so a returned map stays valid after it is dropped
+template <typename Key, typename Map = cv::Mat> class MapCache
+{
+public:
+	MapCache(size_t capacity = 4) : capacity(capacity) {}
+
+	// Map for key, build(Map& map) is called only if it is not cached
+	template <typename Build> Map Get(const Key& key, Build build)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			if (entries[i].key == key)
+			{
+				std::rotate(entries.begin(), entries.begin() + i, entries.begin() + i + 1);	// Most recent first
+				return entries.front().map;
+			}
+		}
+
+		Entry entry = { key, Map() };
+		build(entry.map);
+		entries.insert(entries.begin(), entry);
+		if (entries.size() > capacity) entries.pop_back();
+
+		return entries.front().map;
+	}
+
+private:
+	struct Entry
+	{
+		Key key;
+		Map map;
+	};
+
+	size_t capacity;
+	std::vector<Entry> entries;
+	std::mutex lock;
+};
@@ -0,0 +1,37 @@
+#pragma once
+#include "stdafx.h"
+
+// Instruction sets used by the hand vectorized loops
+// SSE2 is part of every x64 target, so SSE2 code is used as the baseline and needs no check
+// AVX2 code is compiled even when the project itself is not built for AVX2 (default MSVC x64 build)
+// and it is called only when the CPU supports it
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DIP_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__) || defined(_M_X64) || defined(__x86_64__)
+#define DIP_AVX2
+#include <immintrin.h>
+#endif
+
+// GCC and Clang compile intrinsics only in functions built for their instruction set, MSVC accepts them anywhere
+#if defined(__GNUC__) && !defined(__AVX2__)
+#define DIP_AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define DIP_AVX2_TARGET
+#endif
+
+// True when functions marked DIP_AVX2_TARGET may be called, checked once
+static bool HasAvx2()
+{
+#if defined(__AVX2__)
+	return true;
+#elif defined(DIP_AVX2)
+	static const bool supported = cv::checkHardwareSupport(CV_CPU_AVX2);
+	return supported;
+#else
+	return false;
+#endif
+}